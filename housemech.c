@@ -27,6 +27,7 @@
 
 #include "echttp.h"
 #include "echttp_static.h"
+#include "echttp_json.h"
 #include "houseportalclient.h"
 
 #include "housediscover.h"
@@ -36,9 +37,15 @@
 #include "housealmanac.h"
 #include "housecapture.h"
 
+#include "housemech_timer.h"
 #include "housemech_event.h"
 #include "housemech_sensor.h"
+#include "housemech_saga.h"
+#include "housemech_feed.h"
+#include "housemech_state.h"
 #include "housemech_rule.h"
+#include "housemech_worker.h"
+#include "housemech_profile.h"
 #include "housemech_control.h"
 
 static int Debug = 0;
@@ -59,9 +66,10 @@ static const char *housemech_status (const char *method, const char *uri,
                        "{\"host\":\"%s\",\"proxy\":\"%s\",\"timestamp\":%lld",
                        host, houseportal_server(), (long long)time(0));
 
-    cursor += housemech_event_status (buffer+cursor, sizeof(buffer)-cursor);
-    cursor += housemech_sensor_status (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += housemech_feed_status (buffer+cursor, sizeof(buffer)-cursor);
     cursor += housemech_rule_status (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += housemech_worker_status (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += housemech_profile_status (buffer+cursor, sizeof(buffer)-cursor);
     cursor += housealmanac_status (buffer+cursor, sizeof(buffer)-cursor);
     cursor += housemech_control_status (buffer+cursor, sizeof(buffer)-cursor);
 
@@ -71,6 +79,64 @@ static const char *housemech_status (const char *method, const char *uri,
     return buffer;
 }
 
+static const char *housemech_state (const char *method, const char *uri,
+                                     const char *data, int length) {
+    static char buffer[65537];
+    static char host[256];
+
+    int cursor;
+
+    if (host[0] == 0) gethostname (host, sizeof(host));
+
+    cursor = snprintf (buffer, sizeof(buffer),
+                       "{\"host\":\"%s\",\"proxy\":\"%s\",\"timestamp\":%lld",
+                       host, houseportal_server(), (long long)time(0));
+
+    cursor += housemech_state_status (buffer+cursor, sizeof(buffer)-cursor,
+                                      echttp_parameter_get("category"),
+                                      echttp_parameter_get("name"));
+
+    snprintf (buffer+cursor, sizeof(buffer)-cursor, "}");
+
+    echttp_content_type_json ();
+    return buffer;
+}
+
+static const char *housemech_profile (const char *method, const char *uri,
+                                       const char *data, int length) {
+    static char buffer[262145];
+    static char host[256];
+
+    int cursor;
+
+    if (host[0] == 0) gethostname (host, sizeof(host));
+
+    cursor = snprintf (buffer, sizeof(buffer),
+                       "{\"host\":\"%s\",\"proxy\":\"%s\",\"timestamp\":%lld",
+                       host, houseportal_server(), (long long)time(0));
+
+    cursor += housemech_profile_details (buffer+cursor, sizeof(buffer)-cursor);
+
+    snprintf (buffer+cursor, sizeof(buffer)-cursor, "}");
+
+    echttp_content_type_json ();
+    return buffer;
+}
+
+static const char *housemech_notify (const char *method, const char *uri,
+                                      const char *data, int length) {
+
+    const char *point = echttp_parameter_get("point");
+    const char *state = echttp_parameter_get("state");
+
+    if ((!point) || (!state)) {
+        echttp_error (400, "missing point or state");
+        return "";
+    }
+    housemech_control_notify (point, state);
+    return "";
+}
+
 static const char *housemech_set (const char *method, const char *uri,
                                    const char *data, int length) {
     // TBD
@@ -82,6 +148,8 @@ static void housemech_background (int fd, int mode) {
     static time_t LastCall = 0;
     time_t now = time(0);
 
+    housemech_timer_background (); // Only a fallback, see housemech_timer.c
+
     if (now == LastCall) return;
     LastCall = now;
 
@@ -91,8 +159,6 @@ static void housemech_background (int fd, int mode) {
     housedepositor_periodic (now);
     housecapture_background (now);
 
-    housemech_event_background (now);
-    housemech_sensor_background (now);
     housemech_control_background (now);
     housealmanac_background (now);
     housemech_rule_background (now);
@@ -132,12 +198,19 @@ int main (int argc, const char **argv) {
 
     housealmanac_tonight_ready (); // Tell we want to fetch the "tonight" set.
 
+    housemech_timer_initialize (argc, argv);
+    housemech_state_initialize (argc, argv);
+    housemech_control_initialize (argc, argv);
     housemech_rule_initialize (argc, argv);
     housemech_sensor_initialize (argc, argv);
     housemech_event_initialize (argc, argv);
+    housemech_feed_initialize (argc, argv);
 
     echttp_route_uri ("/mech/set", housemech_set);
     echttp_route_uri ("/mech/status", housemech_status);
+    echttp_route_uri ("/mech/state", housemech_state);
+    echttp_route_uri ("/mech/rules/profile", housemech_profile);
+    echttp_route_uri ("/mech/control/notify", housemech_notify);
     echttp_background (&housemech_background);
     echttp_loop();
 }
@@ -26,6 +26,7 @@
  * servers:
  * - Run periodic discoveries to find which server handles each control.
  * - Handle the HTTP control requests (and redirects).
+ * - Handle the state change notifications pushed by the servers.
  *
  * Each control is independent of each other: see the zone and feed
  * modules for the application logic that applies to controls.
@@ -33,6 +34,10 @@
  * This module remembers which controls are active, so that it does not
  * have to stop every known control on cancel.
  *
+ * void housemech_control_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
  * int housemech_control_ready (void);
  *
  *    Return 1 is at least one control point is known, 0 otherwise.
@@ -64,18 +69,43 @@
  *
  *    Return the current state of the specified control.
  *
+ * void housemech_control_notify (const char *name, const char *state);
+ *
+ *    Record a state change notified by a control server. A server that
+ *    notifies its state changes is then only polled for consistency, at
+ *    a much slower pace (see option -control-sweep).
+ *
  * void housemech_control_background (time_t now);
  *
  *    The periodic function that detects the control servers.
  *
+ * The end of a pulse is detected using the timer module, independently
+ * of the periodic function.
+ *
  * int housemech_control_status (char *buffer, int size);
  *
  *    Return the status of control points in JSON format.
+ *
+ * The controls are stored in fixed size slabs, so that a control never
+ * moves once created. Each control is identified by a handle, its
+ * position in the slabs, and the asynchronous callbacks (HTTP responses,
+ * pulse timers) refer to the control by handle.
+ *
+ * The controls are found by name using an open addressing hash index,
+ * which stores handles. Controls are never removed.
+ *
+ * A control record is kept small: the provider URL is an index in a
+ * table of all the providers ever seen, and the state is an index in a
+ * table of all the states ever seen (on, off, etc). These tables are
+ * expected to remain short, and are never reduced.
  */
 
 #include <string.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <echttp.h>
 #include <echttp_json.h>
@@ -85,53 +115,268 @@
 #include "housediscover.h"
 
 #include "housemech_rule.h"
+#include "housemech_timer.h"
 #include "housemech_control.h"
 
 #define DEBUG if (echttp_isdebug()) printf
 
-static char **Providers = 0;
-static int   ProvidersCount = 0;
-static int   ProvidersAllocated = 0;
-
+// The fingerprint of the latest response from each provider is kept,
+// so that an unchanged response is ignored without being parsed.
+//
+typedef struct {
+    char *url;
+    unsigned long long fingerprint;
+    int notified; // Count of state change notifications.
+    int pending;  // The notification count when the latest poll was sent.
+    time_t polled;
+} HouseControlProvider;
+
+static HouseControlProvider *Providers = 0;
+static int ProvidersCount = 0;
+static int ProvidersAllocated = 0;
+
+// How often (in seconds) the providers that notify state changes are
+// polled anyway, in case a notification was lost.
+//
+static int ControlSweep = 60;
+static int ControlRescan = 1; // Poll all providers on the next discovery.
+
+// A notification for an unknown point causes all providers to be polled,
+// but not more often than this (in seconds).
+//
+#define HOUSE_CONTROL_RESCAN 10
+
+// The providers found during the latest discovery (indexes in Providers).
+static int *Discovered = 0;
+static int  DiscoveredCount = 0;
+static int  DiscoveredAllocated = 0;
+
+// State 0 is the empty string, used when the state is not known.
+#define HOUSE_CONTROL_STATES 65536
+
+static char **States = 0;
+static int    StatesCount = 0;
+static int    StatesAllocated = 0;
+
+// The fields used by the scans come first.
 typedef struct {
-    const char *name;
-    char *state;
     char status;
+    short provider; // -1 if not known.
+    unsigned short state;
+    int handle;
     time_t deadline;
-    char url[256];
+    long long timer;
+    const char *name;
 } HouseControl;
 
-static HouseControl *Controls = 0;
-static int           ControlsCount = 0;
-static int           ControlsSize = 0;
+#define HOUSE_CONTROL_SLAB 256 // Controls per slab.
 
-static int ControlsActive = 0;
+static HouseControl **Controls = 0;
+static int            ControlsCount = 0;
+static int            ControlsSlabs = 0;
 
-static HouseControl *housemech_control_search (const char *name) {
+static int housemech_control_provider (const char *url) {
 
     int i;
-    for (i = 0; i < ControlsCount; ++i) {
-        if (!strcmp (name, Controls[i].name)) return Controls + i;
+    for (i = 0; i < ProvidersCount; ++i) {
+        if (!strcmp (url, Providers[i].url)) return i;
+    }
+    if (ProvidersCount >= ProvidersAllocated) {
+        ProvidersAllocated += 16;
+        Providers = realloc (Providers,
+                             ProvidersAllocated*(sizeof(HouseControlProvider)));
+    }
+    Providers[ProvidersCount].url = strdup (url);
+    Providers[ProvidersCount].fingerprint = 0;
+    Providers[ProvidersCount].notified = 0;
+    Providers[ProvidersCount].pending = 0;
+    Providers[ProvidersCount].polled = 0;
+    return ProvidersCount++;
+}
+
+static int housemech_control_intern (const char *state) {
+
+    int i;
+    if (!States) {
+        StatesAllocated = 16;
+        States = calloc (StatesAllocated, sizeof(char *));
+        States[StatesCount++] = "";
+    }
+    for (i = 0; i < StatesCount; ++i) {
+        if (!strcmp (state, States[i])) return i;
+    }
+    if (StatesCount >= HOUSE_CONTROL_STATES) {
+        houselog_trace (HOUSE_FAILURE, state, "too many control states");
+        return 0;
+    }
+    if (StatesCount >= StatesAllocated) {
+        StatesAllocated += 16;
+        States = realloc (States, StatesAllocated*(sizeof(char *)));
+    }
+    States[StatesCount] = strdup (state);
+    return StatesCount++;
+}
+
+// Forget all fingerprints, so that the next responses are all processed.
+//
+static void housemech_control_forget (void) {
+    int i;
+    for (i = 0; i < ProvidersCount; ++i) Providers[i].fingerprint = 0;
+}
+
+// A 64 bit FNV-1a hash of a response. The value of the "timestamp" items
+// is ignored, since it changes with every response.
+//
+static unsigned long long housemech_control_fingerprint (const char *data,
+                                                         int length) {
+    static const char Timestamp[] = "\"timestamp\":";
+    int skip = sizeof(Timestamp) - 1;
+    unsigned long long hash = 14695981039346656037ull;
+
+    int i;
+    for (i = 0; i < length; ++i) {
+        if ((data[i] == '"') && (length - i > skip) &&
+            (!strncmp (data + i, Timestamp, skip))) {
+            for (i += skip; i < length; ++i) {
+                if ((!isdigit(data[i])) && (data[i] != ' ')) break;
+            }
+            if (i >= length) break;
+        }
+        hash ^= (unsigned char)(data[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static HouseControl *housemech_control_get (int handle) {
+    return Controls[handle / HOUSE_CONTROL_SLAB]
+                   + (handle % HOUSE_CONTROL_SLAB);
+}
+
+// The hash index has a power of 2 size, and is kept at most half full.
+// Each slot contains the control's handle plus 1 (0 means empty).
+//
+static int          *ControlsIndex = 0;
+static unsigned int  ControlsIndexSize = 0;
+
+static unsigned int housemech_control_hash (const char *name) {
+
+    // FNV-1a hash of the name.
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char)(*name++);
+        hash *= 16777619u;
     }
+    return hash;
+}
+
+static void housemech_control_index (int handle) {
+
+    unsigned int mask = ControlsIndexSize - 1;
+    unsigned int slot =
+        housemech_control_hash (housemech_control_get(handle)->name) & mask;
+    while (ControlsIndex[slot]) slot = (slot + 1) & mask;
+    ControlsIndex[slot] = handle + 1;
+}
+
+static void housemech_control_reindex (void) {
+
+    int i;
+    ControlsIndexSize = ControlsIndexSize ? ControlsIndexSize * 2 : 64;
+    free (ControlsIndex);
+    ControlsIndex = calloc (ControlsIndexSize, sizeof(int));
+    if (!ControlsIndex) {
+        houselog_trace (HOUSE_FAILURE, "CONTROL", "no more memory");
+        exit (1);
+    }
+    for (i = 0; i < ControlsCount; ++i) housemech_control_index (i);
+}
+
+// Return the named control, or 0 if this control was never seen.
+//
+static HouseControl *housemech_control_find (const char *name) {
+
+    if (ControlsIndexSize > 0) {
+        unsigned int mask = ControlsIndexSize - 1;
+        unsigned int slot = housemech_control_hash (name) & mask;
+        while (ControlsIndex[slot]) {
+            HouseControl *control =
+                housemech_control_get (ControlsIndex[slot] - 1);
+            if (!strcmp (name, control->name)) return control;
+            slot = (slot + 1) & mask;
+        }
+    }
+    return 0;
+}
+
+static HouseControl *housemech_control_search (const char *name) {
+
+    int i;
+    HouseControl *control = housemech_control_find (name);
+    if (control) return control;
 
     // This control was never seen before.
 
-    if (ControlsCount >= ControlsSize) {
-        ControlsSize += 32;
-        Controls = realloc (Controls, ControlsSize*sizeof(HouseControl));
-        if (!Controls) {
+    if (ControlsCount >= ControlsSlabs * HOUSE_CONTROL_SLAB) {
+        // Only the list of slabs is reallocated: no control moves.
+        if ((ControlsSlabs % 16) == 0) {
+            Controls = realloc (Controls,
+                                (ControlsSlabs+16)*sizeof(HouseControl *));
+            if (!Controls) {
+                houselog_trace (HOUSE_FAILURE, name, "no more memory");
+                exit (1);
+            }
+        }
+        Controls[ControlsSlabs] =
+            malloc (HOUSE_CONTROL_SLAB * sizeof(HouseControl));
+        if (!Controls[ControlsSlabs]) {
             houselog_trace (HOUSE_FAILURE, name, "no more memory");
             exit (1);
         }
+        ControlsSlabs += 1;
     }
     i = ControlsCount++;
-    Controls[i].name = strdup(name);
-    Controls[i].state = 0;
-    Controls[i].status = 'u';
-    Controls[i].deadline = 0;
-    Controls[i].url[0] = 0; // Need to (re)learn.
+    control = housemech_control_get (i);
+    control->name = strdup(name);
+    control->handle = i;
+    control->state = housemech_control_intern (""); // Not known.
+    control->status = 'u';
+    control->deadline = 0;
+    control->timer = 0;
+    control->provider = -1; // Need to (re)learn.
+
+    if (2 * ControlsCount > ControlsIndexSize)
+        housemech_control_reindex ();
+    else
+        housemech_control_index (i);
 
-    return Controls + i;
+    return control;
+}
+
+static void housemech_control_expire (void *context) {
+
+    // No request: the control automatically stops on end of pulse.
+    HouseControl *control = housemech_control_get ((intptr_t)context);
+    control->timer = 0;
+    control->deadline = 0;
+    if (control->status == 'a') control->status = 'i';
+}
+
+static void housemech_control_clear (HouseControl *control) {
+
+    if (control->timer) {
+        housemech_timer_cancel (control->timer);
+        control->timer = 0;
+    }
+    control->deadline = 0;
+}
+
+static void housemech_control_change (HouseControl *control,
+                                      const char *state) {
+
+    if (!strcmp (state, States[control->state])) return;
+    if (control->state) housemech_rule_trigger_control (control->name, state);
+    control->state = housemech_control_intern (state);
 }
 
 static ParserToken *housemech_control_prepare (int count) {
@@ -146,12 +391,22 @@ static ParserToken *housemech_control_prepare (int count) {
     return EventTokens;
 }
 
-static void housemech_control_update (const char *provider,
-                                      char *data, int length) {
+static void housemech_control_update (int source, char *data, int length) {
 
-   char path[256];
+   const char *provider = Providers[source].url;
    int  i;
 
+   if ((!data) || (length <= 0)) {
+       houselog_trace (HOUSE_FAILURE, provider, "no data");
+       return;
+   }
+   unsigned long long fingerprint =
+       housemech_control_fingerprint (data, length);
+   if (fingerprint == Providers[source].fingerprint) {
+       DEBUG ("Response from %s did not change\n", provider);
+       return;
+   }
+
    int count = echttp_json_estimate(data);
    ParserToken *tokens = housemech_control_prepare (count);
 
@@ -181,35 +436,31 @@ static void housemech_control_update (const char *provider,
    int *innerlist = calloc (n, sizeof(int));
    error = echttp_json_enumerate (tokens+controls, innerlist, n);
    if (error) {
-       houselog_trace (HOUSE_FAILURE, path, "%s", error);
+       houselog_trace (HOUSE_FAILURE, provider, "%s", error);
        goto cleanup;
    }
 
    for (i = 0; i < n; ++i) {
        ParserToken *inner = tokens + controls + innerlist[i];
        HouseControl *control = housemech_control_search (inner->key);
-       if (strcmp (control->url, provider)) {
-           snprintf (control->url, sizeof(control->url), provider);
+       if (control->provider != source) {
+           // The previous provider might now have stale data.
+           housemech_control_forget ();
+           control->provider = source;
            control->status = 'i';
            houselog_event_local
-               ("CONTROL", control->name, "ROUTE", "TO %s", control->url);
+               ("CONTROL", control->name, "ROUTE", "TO %s", provider);
        }
        int stateidx = echttp_json_search (inner, ".state");
        if (stateidx > 0) {
            char *state = inner[stateidx].value.string;
-           DEBUG ("Received point %s with state %s (previous: %s)\n", control->name, state, control->state?control->state:"unknown");
-           if (control->state) {
-               if (strcmp (state, control->state)) {
-                   housemech_rule_trigger_control (control->name, state);
-                   free (control->state);
-                   control->state = strdup (state);
-               }
-           } else {
-               control->state = strdup (state);
-           }
+           DEBUG ("Received point %s with state %s (previous: %s)\n", control->name, state, control->state?States[control->state]:"unknown");
+           housemech_control_change (control, state);
        }
    }
 
+   Providers[source].fingerprint = fingerprint;
+
 cleanup:
    free (innerlist);
 }
@@ -217,7 +468,7 @@ cleanup:
 static void housemech_control_result
                (void *origin, int status, char *data, int length) {
 
-   HouseControl *control = (HouseControl *)origin;
+   HouseControl *control = housemech_control_get ((intptr_t)origin);
 
    status = echttp_redirected("GET");
    if (!status) {
@@ -229,9 +480,9 @@ static void housemech_control_result
        if (control->status != 'e')
            houselog_trace (HOUSE_FAILURE, control->name, "HTTP code %d", status);
        control->status  = 'e';
-       control->deadline  = 0;
+       housemech_control_clear (control);
    }
-   housemech_control_update (control->url, data, length);
+   housemech_control_update (control->provider, data, length);
 }
 
 static const char *housemech_printable_period (int h, const char *hlabel,
@@ -277,6 +528,20 @@ static const char *housemech_printable_reason (const char *reason) {
     return Printable;
 }
 
+void housemech_control_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *sweep = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-control-sweep=", argv[i], &sweep)) continue;
+    }
+    if (sweep) {
+        ControlSweep = atoi (sweep);
+        if (ControlSweep < 0) ControlSweep = 0;
+    }
+}
+
 int housemech_control_ready (void) {
     return ControlsCount > 0;
 }
@@ -300,7 +565,7 @@ int housemech_control_set (const char *name, const char *state,
            (long long)now, name, state, pulse);
 
     HouseControl *control = housemech_control_search (name);
-    if (! control->url[0]) {
+    if (control->provider < 0) {
         houselog_event ("CONTROL", name, "UNKNOWN", "");
         return 0;
     }
@@ -309,7 +574,7 @@ int housemech_control_set (const char *name, const char *state,
     if (verbose) {
         houselog_event ("CONTROL", name, state, "%sUSING %s%s",
                         housemech_printable_duration (pulse),
-                        control->url,
+                        Providers[control->provider].url,
                         housemech_printable_reason (reason));
     }
 
@@ -319,7 +584,7 @@ int housemech_control_set (const char *name, const char *state,
     static char url[800];
     snprintf (url, sizeof(url),
               "%s/set?point=%s&state=%s&pulse=%d%s",
-              control->url, encoded, state, pulse,
+              Providers[control->provider].url, encoded, state, pulse,
               housemech_control_cause(reason));
     const char *error = echttp_client ("GET", url);
     if (error) {
@@ -327,11 +592,16 @@ int housemech_control_set (const char *name, const char *state,
         return 0;
     }
     DEBUG ("GET %s\n", url);
-    echttp_submit (0, 0, housemech_control_result, (void *)control);
-    if (pulse > 0)
+    echttp_submit (0, 0, housemech_control_result,
+                   (void *)(intptr_t)(control->handle));
+    housemech_control_clear (control);
+    if (pulse > 0) {
         control->deadline = now + pulse;
+        control->timer = housemech_timer_start
+                             ((long long)pulse * 1000, housemech_control_expire,
+                              (void *)(intptr_t)(control->handle));
+    }
     control->status = 'a';
-    ControlsActive = 1;
     return 1;
 }
 
@@ -342,7 +612,7 @@ int housemech_control_start (const char *name, int pulse,
 
 static void housemech_control_stop (HouseControl *control, const char *reason) {
 
-    if (! control->url[0]) return;
+    if (control->provider < 0) return;
 
     char encoded[64];
     echttp_encoding_escape (control->name, encoded, sizeof(encoded));
@@ -350,16 +620,18 @@ static void housemech_control_stop (HouseControl *control, const char *reason) {
     static char url[800];
     snprintf (url, sizeof(url),
               "%s/set?point=%s&state=off%s",
-              control->url, encoded, housemech_control_cause(reason));
+              Providers[control->provider].url,
+              encoded, housemech_control_cause(reason));
     const char *error = echttp_client ("GET", url);
     if (error) {
         houselog_trace (HOUSE_FAILURE, control->name, "cannot create socket for %s, %s", url, error);
         return;
     }
     DEBUG ("GET %s\n", url);
-    echttp_submit (0, 0, housemech_control_result, (void *)control);
+    echttp_submit (0, 0, housemech_control_result,
+                   (void *)(intptr_t)(control->handle));
     if (control->status == 'a') control->status = 'i';
-    control->deadline = 0;
+    housemech_control_clear (control);
 }
 
 void housemech_control_cancel (const char *name, const char *reason) {
@@ -370,14 +642,14 @@ void housemech_control_cancel (const char *name, const char *reason) {
     if (name) {
         DEBUG ("Trying to cancel point %s\n", name);
         HouseControl *control = housemech_control_search (name);
-        if (control->url[0]) {
+        if (control->provider >= 0) {
             DEBUG ("Canceling point %s\n", name);
             // Do not generate an event if the control was not activated by
             // this service instance: such spurious events are confusing.
             //
             if (control->status == 'a')
                 houselog_event ("CONTROL", name, "CANCEL", "USING %s%s",
-                                control->url,
+                                Providers[control->provider].url,
                                 housemech_printable_reason (reason));
             // Event if the control was not activated by this service instance,
             // still stop it, just to be sure.
@@ -392,23 +664,23 @@ void housemech_control_cancel (const char *name, const char *reason) {
         // every possible control point, limit the actions to pending (active)
         // actions initiated by this service instance only.
         //
-        if (Controls[i].status == 'a') {
-            housemech_control_stop ( Controls + i, reason);
+        HouseControl *control = housemech_control_get (i);
+        if (control->status == 'a') {
+            housemech_control_stop (control, reason);
         }
     }
-    ControlsActive = 0;
 }
 
 const char *housemech_control_state (const char *name) {
     HouseControl *control = housemech_control_search (name);
-    if (! control->state) return "";
-    return control->state;
+    return States[control->state];
 }
 
 static void housemech_control_discovered
                (void *origin, int status, char *data, int length) {
 
-   const char *provider = (const char *) origin;
+   int source = (int)(intptr_t)origin;
+   const char *provider = Providers[source].url;
 
    status = echttp_redirected("GET");
    if (!status) {
@@ -421,7 +693,10 @@ static void housemech_control_discovered
        return;
    }
 
-   housemech_control_update (provider, data, length);
+   // This response might be older than a notification received since.
+   if (Providers[source].notified != Providers[source].pending) return;
+
+   housemech_control_update (source, data, length);
 }
 
 static void housemech_control_scan_server
@@ -429,11 +704,21 @@ static void housemech_control_scan_server
 
     char url[256];
 
-    if (ProvidersCount >= ProvidersAllocated) {
-        ProvidersAllocated += 64;
-        Providers = realloc (Providers, ProvidersAllocated*(sizeof(char *)));
+    int source = housemech_control_provider (provider);
+    if (DiscoveredCount >= DiscoveredAllocated) {
+        DiscoveredAllocated += 16;
+        Discovered = realloc (Discovered, DiscoveredAllocated*(sizeof(int)));
     }
-    Providers[ProvidersCount++] = strdup(provider); // Keep the string.
+    Discovered[DiscoveredCount++] = source;
+
+    // A provider that notifies its state changes is only polled for
+    // consistency, unless all providers must be polled now.
+    //
+    time_t now = time(0);
+    if ((!context) && Providers[source].notified &&
+        (now < Providers[source].polled + ControlSweep)) return;
+    Providers[source].polled = now;
+    Providers[source].pending = Providers[source].notified;
 
     snprintf (url, sizeof(url), "%s/status", provider);
 
@@ -443,7 +728,8 @@ static void housemech_control_scan_server
         houselog_trace (HOUSE_FAILURE, provider, "%s", error);
         return;
     }
-    echttp_submit (0, 0, housemech_control_discovered, (void *)provider);
+    echttp_submit (0, 0, housemech_control_discovered,
+                   (void *)(intptr_t)source);
 }
 
 static void housemech_control_discover (time_t now) {
@@ -452,6 +738,8 @@ static void housemech_control_discover (time_t now) {
 
     if (!now) { // This is a manual reset (force a discovery refresh)
         latestdiscovery = 0;
+        ControlRescan = 1;
+        housemech_control_forget ();
         return;
     }
 
@@ -460,6 +748,7 @@ static void housemech_control_discover (time_t now) {
     if ((latestdiscovery > 0) &&
         housediscover_changed ("control", latestdiscovery)) {
         latestdiscovery = 0;
+        ControlRescan = 1;
     }
 
     // Even if nothing new was detected, still scan every few seconds, in case
@@ -472,33 +761,41 @@ static void housemech_control_discover (time_t now) {
     // refresh. This way we don't walk a stale cache while doing discovery.
     //
     DEBUG ("Reset providers cache\n");
-    int i;
-    for (i = 0; i < ProvidersCount; ++i) {
-        if (Providers[i]) free(Providers[i]);
-        Providers[i] = 0;
-    }
-    ProvidersCount = 0;
+    DiscoveredCount = 0;
     DEBUG ("Proceeding with discovery\n");
-    housediscovered ("control", 0, housemech_control_scan_server);
+    housediscovered ("control", (void *)(intptr_t)ControlRescan,
+                     housemech_control_scan_server);
+    ControlRescan = 0;
 }
 
-void housemech_control_background (time_t now) {
+void housemech_control_notify (const char *name, const char *state) {
 
-    if (ControlsActive) {
-        ControlsActive = 0;
-        int i;
-        for (i = 0; i < ControlsCount; ++i) {
-            if (Controls[i].deadline) {
-                if (Controls[i].deadline < now) {
-                    // No request: it automatically stops on end of pulse.
-                    Controls[i].deadline = 0;
-                    Controls[i].status  = 'i';
-                } else {
-                    ControlsActive = 1;
-                }
-            }
+    static time_t LatestRescan = 0;
+
+    HouseControl *control = housemech_control_find (name);
+
+    DEBUG ("Notified point %s with state %s\n", name, state);
+    if ((!control) || (control->provider < 0)) {
+        // This point is not known yet: find its server soon.
+        time_t now = time(0);
+        if (now >= LatestRescan + HOUSE_CONTROL_RESCAN) {
+            LatestRescan = now;
+            housemech_control_discover (0);
         }
+        return;
     }
+    Providers[control->provider].notified += 1;
+
+    // The state now differs from the latest response parsed: that same
+    // response must not be ignored by the next sweep, or else a lost
+    // notification would never be repaired.
+    //
+    Providers[control->provider].fingerprint = 0;
+    housemech_control_change (control, state);
+}
+
+void housemech_control_background (time_t now) {
+
     housemech_control_discover (now);
 }
 
@@ -511,9 +808,9 @@ int housemech_control_status (char *buffer, int size) {
     cursor = snprintf (buffer, size, ",\"servers\":[");
     if (cursor >= size) goto overflow;
 
-    for (i = 0; i < ProvidersCount; ++i) {
+    for (i = 0; i < DiscoveredCount; ++i) {
         cursor += snprintf (buffer+cursor, size-cursor,
-                            "%s\"%s\"", prefix, Providers[i]);
+                            "%s\"%s\"", prefix, Providers[Discovered[i]].url);
         if (cursor >= size) goto overflow;
         prefix = ",";
     }
@@ -524,12 +821,13 @@ int housemech_control_status (char *buffer, int size) {
     time_t now = time(0);
 
     for (i = 0; i < ControlsCount; ++i) {
-        if (Controls[i].status != 'a') continue; // List only active controls.
+        HouseControl *control = housemech_control_get (i);
+        if (control->status != 'a') continue; // List only active controls.
         cursor += snprintf (buffer+cursor, size-cursor,
                             "%s[\"%s\",\"%s\",%d]",
-                            prefix, Controls[i].name,
-                            Controls[i].url,
-                            (int)(Controls[i].deadline - now));
+                            prefix, control->name,
+                            Providers[control->provider].url,
+                            (int)(control->deadline - now));
         if (cursor >= size) goto overflow;
         prefix = ",";
     }
@@ -20,6 +20,8 @@
  *
  * housemech_control.h - Interface with the control servers.
  */
+void housemech_control_initialize (int argc, const char **argv);
+
 int housemech_control_ready (void);
 
 int housemech_control_set     (const char *name, const char *state,
@@ -29,6 +31,7 @@ int housemech_control_start   (const char *name,
 void housemech_control_cancel (const char *name, const char *reason);
 
 const char *housemech_control_state  (const char *name);
+void housemech_control_notify (const char *name, const char *state);
 
 int housemech_control_status (char *buffer, int size);
 void housemech_control_background (time_t now);
@@ -21,6 +21,4 @@
  * housemech_event.h - Manage the interface with HouseSaga.
  */
 void housemech_event_initialize (int argc, const char **argv);
-int  housemech_event_status (char *buffer, int size);
-void housemech_event_background (time_t now);
 
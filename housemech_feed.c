@@ -0,0 +1,1212 @@
+/* HouseMech - A simple home web service to automate actions.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemech_feed.c - Fetch new records from HouseSaga.
+ *
+ * SYNOPSYS:
+ *
+ * This module fetches new records from the history service (HouseSaga).
+ * Multiple streams of records can be fetched (events, sensor data, ..):
+ * all streams share the same server discovery, the same server lock and
+ * the same parser buffer. Each stream provides its own record handler.
+ *
+ * New records are fetched using a single conditional request: the request
+ * tells the latest record ID already known, and the server either returns
+ * the new records or tells that nothing changed (HTTP 304, or an empty
+ * list).
+ *
+ * Long poll support: once locked on a server, ask that server to hold
+ * the request until a new record is recorded, so that new records are
+ * detected without waiting for the next polling cycle. A server that
+ * does not support long polls answers immediately, and this module then
+ * keeps polling periodically. A long poll that fails after being held
+ * for a while is taken as an HTTP client timeout, not as a server failure:
+ * the wait period is then shortened instead of unlocking the server.
+ *
+ * Adaptive polling: the polling period shortens to a floor value
+ * (-feed-floor option, in milliseconds) as soon as new records are
+ * received, and then lengthens progressively, up to a ceiling value
+ * (-feed-ceiling option), while nothing changes.
+ *
+ * Checkpoint: the position of each stream is saved to a small memory
+ * mapped file, so that a restart resumes where the previous run stopped
+ * instead of ignoring every record that occurred in between. The replay
+ * is limited to a maximum age (-feed-replay option, in seconds). The file
+ * is synchronized to disk every HOUSE_FEED_SYNC seconds, when changed.
+ * The position saved is the latest record actually processed, not the
+ * latest record queued, so that the queued records are not lost when
+ * the service stops.
+ *
+ * Failover: while locked on one server, this module also tracks a second
+ * history server (the standby), using the same since watermark. The IDs
+ * are specific to each server, so the standby's records are reconciled
+ * using their timestamps: the standby ID of the latest record already
+ * processed is remembered. If the locked server fails, the standby takes
+ * over in the same cycle and its records are fetched from that ID, without
+ * duplicate or missing records.
+ *
+ * Queue: the new records are not processed while decoding the HTTP
+ * response. Instead they are stored in a bounded queue, which is drained
+ * under a time budget (-feed-budget option, in milliseconds), so that a
+ * large batch of records does not stall the service. When the queue is
+ * almost full, no new records are requested. When a response does not
+ * fit in the queue, the default policy is to stop there and fetch the
+ * remaining records later (no loss); the -feed-drop=oldest option selects
+ * dropping the oldest queued records instead, favoring the newest ones.
+ * A handler may refuse a record (e.g. the worker threads are too far
+ * behind): that record stays at the head of the queue, which is drained
+ * again HOUSE_FEED_RETRY milliseconds later.
+ *
+ * Paging: each request asks for at most a page of records (-feed-page
+ * option). When a full page is received, the next page is requested as
+ * soon as this page has been queued, so that catching up after an outage
+ * streams through the backlog with bounded memory use. This expects the
+ * server to return the oldest records that follow the known ID (the list
+ * itself is newest first). If the oldest record in a full page does not
+ * immediately follow the latest record processed, the server might have
+ * kept the newest records instead, or it might just skip IDs: that page is
+ * ignored and a single record is requested to find out which order the
+ * server uses (the paging probe). Only a server that returns its newest
+ * records is then asked for all records at once, so that none is skipped.
+ * The first page from a new or restarted server is always accepted, since
+ * there is no previous record to compare with.
+ *
+ * void housemech_feed_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. This must be called after all streams
+ *    have been registered.
+ *
+ * int housemech_feed_register (const char *name,
+ *                              const char *path, const char *list,
+ *                              int wait, housemech_feed_handler *handler);
+ *
+ *    Declare a new stream of records. The path is the URI used to fetch
+ *    the new records from HouseSaga, list is the JSON path to the list
+ *    of records in the response. The wait parameter is the long poll
+ *    period (0 to disable long polls). The handler is called for every
+ *    new record, oldest first. The handler returns 0 if the record could
+ *    not be processed now, in which case it is submitted again later.
+ *
+ * This module schedules its own polling and queue processing using
+ * the timer module, with no need for a periodic function.
+ *
+ * int housemech_feed_status (char *buffer, int size);
+ *
+ *    A function that populates the status of this module in JSON.
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <echttp.h>
+#include <echttp_json.h>
+
+#include "houselog.h"
+#include "housediscover.h"
+#include "housemech_rule.h"
+#include "housemech_control.h"
+#include "housemech_saga.h"
+#include "housemech_timer.h"
+
+#include "housemech_feed.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_FEED_CYCLE 2
+#define HOUSE_FEED_SYNC  10
+#define HOUSE_FEED_REPLAY 600
+#define HOUSE_FEED_QUEUE  1024
+#define HOUSE_FEED_BUDGET 100
+#define HOUSE_FEED_RETRY  20
+#define HOUSE_FEED_FLOOR  500
+#define HOUSE_FEED_CEILING 8000
+#define HOUSE_FEED_PAGE   200
+
+// The checkpoint file layout. Streams are identified by name.
+//
+#define HOUSE_FEED_MAGIC  0x484d4631 // "HMF1"
+#define HOUSE_FEED_SAVED  16
+
+typedef struct {
+    char name[32];
+    long long latesttime;
+    long long latestid;
+} HouseFeedSavedStream;
+
+typedef struct {
+    int magic;
+    int count;
+    char server[256];
+    HouseFeedSavedStream streams[HOUSE_FEED_SAVED];
+} HouseFeedCheckpoint;
+
+static const char *HouseFeedCheckpointPath =
+                      "/var/lib/house/housemech.checkpoint";
+
+static HouseFeedCheckpoint *Checkpoint = 0;
+static int                  CheckpointDirty = 0;
+
+// The server that the checkpoint's record IDs relate to, if any.
+static char *HouseFeedResumeServer = 0;
+
+typedef struct {
+    const char *name;
+    const char *path;
+    const char *list;
+    int wait;             // The current long poll period (seconds).
+    int maxwait;          // The long poll period requested (seconds).
+    housemech_feed_handler *handler;
+    long long latesttime; // The "since" watermark (milliseconds).
+    long long latestid;   // The latest record processed.
+    long long known;      // The latest record ID reported by the server.
+    long long lasttime;   // The latest record processed (milliseconds).
+    long long standbyid;  // The standby's ID of that latest record.
+    long long processedtime; // The "since" watermark of processed records.
+    long long processedid;   // The latest record processed by the handler.
+    int streaming;        // The server supports long polls.
+    int unpaged;          // Do not limit the next request to one page.
+    int limit;            // The limit of the latest request (0: none).
+    int order;            // The server pages oldest first (1), newest
+                          // first (-1), or this is not known yet (0).
+    long long probing;    // The oldest ID of the page being verified.
+    time_t pending;       // A long poll is outstanding since that time.
+    HouseFeedSavedStream *saved;
+} HouseFeedStream;
+
+static HouseFeedStream *Streams = 0;
+static int              StreamsCount = 0;
+
+// The requests must remember which stream and provider they are for.
+// These routes are never freed, so that they remain valid even if
+// a response never comes back. There is at most one route per stream
+// and provider.
+//
+typedef struct {
+    int stream;
+    char *provider;
+} HouseFeedRoute;
+
+static HouseFeedRoute **Routes = 0;
+static int              RoutesCount = 0;
+static int              RoutesAllocated = 0;
+
+// The queue of records waiting to be processed. The strings referenced
+// by each record are copied in a single block of memory.
+//
+typedef struct {
+    int stream;
+    int generation;
+    HouseMechSagaRecord record;
+    char *data;
+} HouseFeedQueued;
+
+// Record IDs are specific to each server: the generation changes each
+// time a new server is used, so that the ID of a record queued from a
+// previous server is never saved as a position on the new one.
+//
+static int HouseFeedGeneration = 0;
+
+static HouseFeedQueued *Queue = 0;
+static int              QueueSize = HOUSE_FEED_QUEUE;
+static int              QueueProducer = 0;
+static int              QueueConsumer = 0;
+static int              QueueDepth = 0;
+static int              QueueHighest = 0;
+static int              QueueDropOldest = 0;
+static long long        QueueDropped = 0;
+static long long        QueueDeferred = 0;
+static long long        QueueStalled = 0;
+static int              QueueBudget = HOUSE_FEED_BUDGET;
+
+static int HouseFeedPage = HOUSE_FEED_PAGE;
+
+// The adaptive polling period, in milliseconds.
+//
+static int HouseFeedFloor = HOUSE_FEED_FLOOR;
+static int HouseFeedCeiling = HOUSE_FEED_CEILING;
+static int HouseFeedPeriod = HOUSE_FEED_CYCLE * 1000;
+static int HouseFeedActivity = 0;
+
+static char *HouseFeedCurrentServer = 0;
+static char *HouseFeedStandbyServer = 0;
+static int   HouseFeedStandbySeen = 0;
+
+static int       HouseFeedFailovers = 0;
+static time_t    HouseFeedBlindSince = 0;
+static long long HouseFeedBlindTime = 0;
+
+
+static HouseFeedRoute *housemech_feed_route (int stream, const char *provider) {
+
+    int i;
+    for (i = 0; i < RoutesCount; ++i) {
+        if ((Routes[i]->stream == stream) &&
+            (!strcmp (Routes[i]->provider, provider))) return Routes[i];
+    }
+    if (RoutesCount >= RoutesAllocated) {
+        RoutesAllocated += 16;
+        Routes = realloc (Routes, RoutesAllocated*sizeof(HouseFeedRoute *));
+        if (!Routes) {
+            houselog_trace (HOUSE_FAILURE, provider, "no more memory");
+            exit (1);
+        }
+    }
+    HouseFeedRoute *route = malloc (sizeof(HouseFeedRoute));
+    route->stream = stream;
+    route->provider = strdup (provider);
+    Routes[RoutesCount++] = route;
+    return route;
+}
+
+int housemech_feed_register (const char *name,
+                             const char *path, const char *list,
+                             int wait, housemech_feed_handler *handler) {
+
+    Streams = realloc (Streams, (StreamsCount+1)*sizeof(HouseFeedStream));
+    if (!Streams) {
+        houselog_trace (HOUSE_FAILURE, name, "no more memory");
+        exit (1);
+    }
+    HouseFeedStream *stream = Streams + StreamsCount;
+
+    stream->name = name;
+    stream->path = path;
+    stream->list = list;
+    stream->wait = (wait > 0) ? wait : 0;
+    stream->maxwait = stream->wait;
+    stream->handler = handler;
+
+    // Ignore old records, only look forward. Otherwise we would
+    // refetch and reprocess all pre-existing records on restart.
+    stream->latesttime = (long long)time(0) * 1000;
+    stream->lasttime = stream->latesttime;
+    stream->latestid = 0;
+    stream->standbyid = 0;
+    stream->processedtime = stream->latesttime;
+    stream->processedid = 0;
+    stream->known = 0;
+    stream->streaming = 0;
+    stream->unpaged = 0;
+    stream->limit = 0;
+    stream->order = 0;
+    stream->probing = 0;
+    stream->pending = 0;
+    stream->saved = 0;
+
+    return StreamsCount++;
+}
+
+static HouseFeedSavedStream *housemech_feed_saved (const char *name) {
+
+    int i;
+    for (i = 0; i < Checkpoint->count; ++i) {
+        if (!strcmp (Checkpoint->streams[i].name, name))
+            return Checkpoint->streams + i;
+    }
+    if (Checkpoint->count >= HOUSE_FEED_SAVED) return 0;
+
+    HouseFeedSavedStream *saved = Checkpoint->streams + Checkpoint->count++;
+    snprintf (saved->name, sizeof(saved->name), "%s", name);
+    saved->latesttime = 0;
+    saved->latestid = 0;
+    return saved;
+}
+
+static char *housemech_feed_copy (char *cursor, const char **value) {
+    strcpy (cursor, *value);
+    *value = cursor;
+    return cursor + strlen(cursor) + 1;
+}
+
+static int housemech_feed_congested (void) {
+    return QueueDepth >= (QueueSize * 3) / 4;
+}
+
+static int housemech_feed_enqueue (int stream,
+                                   const HouseMechSagaRecord *record) {
+
+    if (QueueDepth >= QueueSize) {
+        if (!QueueDropOldest) return 0;
+        free (Queue[QueueConsumer].data);
+        Queue[QueueConsumer].data = 0;
+        QueueConsumer = (QueueConsumer + 1) % QueueSize;
+        QueueDepth -= 1;
+        QueueDropped += 1;
+    }
+
+    HouseFeedQueued *queued = Queue + QueueProducer;
+    queued->stream = stream;
+    queued->generation = HouseFeedGeneration;
+    queued->record = *record;
+    queued->data = malloc (strlen(record->category) +
+                           strlen(record->name) +
+                           strlen(record->action) + 3);
+    if (!queued->data) {
+        houselog_trace (HOUSE_FAILURE, record->name, "no more memory");
+        exit (1);
+    }
+    char *cursor = queued->data;
+    cursor = housemech_feed_copy (cursor, &(queued->record.category));
+    cursor = housemech_feed_copy (cursor, &(queued->record.name));
+    cursor = housemech_feed_copy (cursor, &(queued->record.action));
+
+    QueueProducer = (QueueProducer + 1) % QueueSize;
+    QueueDepth += 1;
+    if (QueueDepth > QueueHighest) QueueHighest = QueueDepth;
+    return 1;
+}
+
+static int HouseFeedProcessScheduled = 0;
+
+static void housemech_feed_process (void);
+static void housemech_feed_save (HouseFeedStream *stream);
+
+static void housemech_feed_resume (void *context) {
+    HouseFeedProcessScheduled = 0;
+    housemech_feed_process ();
+}
+
+static void housemech_feed_process (void) {
+
+    if (QueueDepth <= 0) return;
+
+    long long deadline = housemech_timer_now() + QueueBudget;
+    do {
+        HouseFeedQueued *queued = Queue + QueueConsumer;
+        HouseFeedStream *stream = Streams + queued->stream;
+
+        // A refused record stays first in the queue, and the positions
+        // saved do not move past it: nothing is lost, even on restart.
+        if (!stream->handler (&(queued->record))) {
+            QueueStalled += 1;
+            if (!HouseFeedProcessScheduled) {
+                housemech_timer_start
+                    (HOUSE_FEED_RETRY, housemech_feed_resume, 0);
+                HouseFeedProcessScheduled = 1;
+            }
+            return;
+        }
+        QueueConsumer = (QueueConsumer + 1) % QueueSize;
+        QueueDepth -= 1;
+
+        // Be lenient in the case records are listed out of order.
+        if (queued->generation == HouseFeedGeneration)
+            stream->processedid = queued->record.id;
+        if (queued->record.timestamp - 5 > stream->processedtime)
+            stream->processedtime = queued->record.timestamp - 5;
+        housemech_feed_save (stream);
+
+        free (queued->data);
+        queued->data = 0;
+
+    } while ((QueueDepth > 0) && (housemech_timer_now() < deadline));
+
+    // Let the main loop serve other activities before resuming.
+    if ((QueueDepth > 0) && !HouseFeedProcessScheduled) {
+        housemech_timer_start (0, housemech_feed_resume, 0);
+        HouseFeedProcessScheduled = 1;
+    }
+}
+
+static void housemech_feed_poll (void *context);
+
+void housemech_feed_initialize (int argc, const char **argv) {
+
+    int i;
+    int replay = HOUSE_FEED_REPLAY;
+    const char *option = 0;
+    const char *queue = 0;
+    const char *budget = 0;
+    const char *drop = 0;
+    const char *minimum = 0;
+    const char *maximum = 0;
+    const char *page = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-feed-checkpoint=", argv[i],
+                                 &HouseFeedCheckpointPath)) continue;
+        if (echttp_option_match ("-feed-replay=", argv[i], &option)) continue;
+        if (echttp_option_match ("-feed-queue=", argv[i], &queue)) continue;
+        if (echttp_option_match ("-feed-budget=", argv[i], &budget)) continue;
+        if (echttp_option_match ("-feed-drop=", argv[i], &drop)) continue;
+        if (echttp_option_match ("-feed-floor=", argv[i], &minimum)) continue;
+        if (echttp_option_match ("-feed-ceiling=", argv[i], &maximum)) continue;
+        if (echttp_option_match ("-feed-page=", argv[i], &page)) continue;
+    }
+    if (option) replay = atoi (option);
+    if (queue) {
+        QueueSize = atoi (queue);
+        if (QueueSize < 16) QueueSize = 16;
+    }
+    if (budget) {
+        QueueBudget = atoi (budget);
+        if (QueueBudget <= 0) QueueBudget = INT_MAX; // No limit.
+    }
+    if (drop) QueueDropOldest = !strcmp (drop, "oldest");
+    if (minimum) {
+        HouseFeedFloor = atoi (minimum);
+        if (HouseFeedFloor < 100) HouseFeedFloor = 100;
+    }
+    if (maximum) HouseFeedCeiling = atoi (maximum);
+    if (HouseFeedCeiling < HouseFeedFloor) HouseFeedCeiling = HouseFeedFloor;
+    if (page) {
+        HouseFeedPage = atoi (page);
+        if (HouseFeedPage < 0) HouseFeedPage = 0; // No paging.
+        if (HouseFeedPage == 1) HouseFeedPage = 2; // See the paging probe.
+    }
+
+    Queue = calloc (QueueSize, sizeof(HouseFeedQueued));
+    if (!Queue) {
+        houselog_trace (HOUSE_FAILURE, "QUEUE", "no more memory");
+        exit (1);
+    }
+    housemech_timer_start (HouseFeedPeriod, housemech_feed_poll, 0);
+
+    if (!HouseFeedCheckpointPath[0]) return; // No checkpoint.
+
+    int fd = open (HouseFeedCheckpointPath, O_RDWR|O_CREAT, 0644);
+    if (fd < 0) {
+        houselog_trace (HOUSE_FAILURE, HouseFeedCheckpointPath,
+                        "cannot open checkpoint file");
+        return;
+    }
+    if (ftruncate (fd, sizeof(HouseFeedCheckpoint)) < 0) {
+        houselog_trace (HOUSE_FAILURE, HouseFeedCheckpointPath,
+                        "cannot size checkpoint file");
+        close (fd);
+        return;
+    }
+    void *map = mmap (0, sizeof(HouseFeedCheckpoint),
+                      PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+        houselog_trace (HOUSE_FAILURE, HouseFeedCheckpointPath,
+                        "cannot map checkpoint file");
+        return;
+    }
+    Checkpoint = (HouseFeedCheckpoint *)map;
+
+    if ((Checkpoint->magic != HOUSE_FEED_MAGIC) ||
+        (Checkpoint->count < 0) || (Checkpoint->count > HOUSE_FEED_SAVED)) {
+        memset (Checkpoint, 0, sizeof(HouseFeedCheckpoint));
+        Checkpoint->magic = HOUSE_FEED_MAGIC;
+        CheckpointDirty = 1;
+    }
+    Checkpoint->server[sizeof(Checkpoint->server)-1] = 0;
+    if (Checkpoint->server[0])
+        HouseFeedResumeServer = strdup (Checkpoint->server);
+
+    // Resume from the checkpoint, but do not replay records that are too
+    // old to still be meaningful.
+    //
+    long long oldest = ((long long)time(0) - replay) * 1000;
+
+    for (i = 0; i < StreamsCount; ++i) {
+        HouseFeedStream *stream = Streams + i;
+        stream->saved = housemech_feed_saved (stream->name);
+        if (!stream->saved) continue;
+        if (stream->saved->latesttime > 0) {
+            stream->latesttime = stream->saved->latesttime;
+            if (stream->latesttime < oldest) stream->latesttime = oldest;
+            stream->lasttime = stream->latesttime;
+            stream->latestid = stream->saved->latestid;
+            stream->processedtime = stream->latesttime;
+            stream->processedid = stream->latestid;
+            DEBUG ("Resume %s from %lld (ID %lld)\n",
+                   stream->name, stream->latesttime, stream->latestid);
+        }
+    }
+}
+
+static void housemech_feed_save (HouseFeedStream *stream) {
+
+    if (!stream->saved) return;
+    stream->saved->latesttime = stream->processedtime;
+    stream->saved->latestid = stream->processedid;
+    CheckpointDirty = 1;
+}
+
+static void housemech_feed_sync (time_t now) {
+
+    static time_t NextSync = 0;
+
+    if (!Checkpoint) return;
+    if (!CheckpointDirty) return;
+    if (now < NextSync) return;
+    NextSync = now + HOUSE_FEED_SYNC;
+
+    msync (Checkpoint, sizeof(HouseFeedCheckpoint), MS_ASYNC);
+    CheckpointDirty = 0;
+}
+
+static void housemech_feed_lock (const char *provider) {
+
+    // Lock on this new provider that seems to be working OK.
+    DEBUG ("Locking on new history source %s\n", provider);
+    HouseFeedCurrentServer = strdup (provider);
+
+    // Record IDs are specific to each server: keep the IDs restored from
+    // the checkpoint only if this is the same server as before the restart.
+    //
+    int resume = 0;
+    if (HouseFeedResumeServer) {
+        resume = !strcmp (HouseFeedResumeServer, provider);
+        free (HouseFeedResumeServer);
+        HouseFeedResumeServer = 0;
+    }
+
+    HouseFeedGeneration += 1;
+
+    int i;
+    for (i = 0; i < StreamsCount; ++i) {
+        if (!resume) {
+            Streams[i].latestid = 0;
+            Streams[i].processedid = 0;
+            housemech_feed_save (Streams + i);
+        }
+        Streams[i].known = 0;
+        Streams[i].order = 0;
+        Streams[i].probing = 0;
+        Streams[i].wait = Streams[i].maxwait;
+    }
+
+    if (Checkpoint) {
+        snprintf (Checkpoint->server, sizeof(Checkpoint->server),
+                  "%s", provider);
+        CheckpointDirty = 1;
+    }
+
+    if (HouseFeedBlindSince) {
+        HouseFeedBlindTime += time(0) - HouseFeedBlindSince;
+        HouseFeedBlindSince = 0;
+    }
+}
+
+static void housemech_feed_forget_standby (void) {
+
+    if (HouseFeedStandbyServer) {
+        free (HouseFeedStandbyServer);
+        HouseFeedStandbyServer = 0;
+    }
+    int i;
+    for (i = 0; i < StreamsCount; ++i) Streams[i].standbyid = 0;
+}
+
+static int housemech_feed_query (int stream, const char *provider);
+
+static void housemech_feed_failover (void) {
+
+    HouseFeedCurrentServer = HouseFeedStandbyServer;
+    HouseFeedStandbyServer = 0;
+    HouseFeedFailovers += 1;
+    houselog_event_local ("HISTORY", "FEED", "FAILOVER",
+                          "TO %s", HouseFeedCurrentServer);
+
+    // The standby's ID of the latest processed record is not known if
+    // some records are still queued: a restart would then resume from
+    // the time of that latest processed record.
+    //
+    HouseFeedGeneration += 1;
+
+    int i;
+    for (i = 0; i < StreamsCount; ++i) {
+        HouseFeedStream *stream = Streams + i;
+        stream->latestid = stream->standbyid;
+        stream->processedid = (QueueDepth > 0) ? 0 : stream->standbyid;
+        stream->standbyid = 0;
+        stream->known = 0;
+        stream->order = 0;
+        stream->probing = 0;
+        housemech_feed_save (stream);
+    }
+    if (Checkpoint) {
+        snprintf (Checkpoint->server, sizeof(Checkpoint->server),
+                  "%s", HouseFeedCurrentServer);
+        CheckpointDirty = 1;
+    }
+
+    // Fetch the records from the new server right away. The route keeps
+    // its own copy of the URL, which remains valid even if this fails.
+    //
+    const char *provider =
+        housemech_feed_route (0, HouseFeedCurrentServer)->provider;
+    for (i = 0; i < StreamsCount; ++i) {
+        if (!housemech_feed_query (i, provider)) break;
+    }
+}
+
+static void housemech_feed_unlock (void) {
+
+    int locked = (HouseFeedCurrentServer != 0);
+
+    if (HouseFeedCurrentServer) {
+        free (HouseFeedCurrentServer);
+        HouseFeedCurrentServer = 0; // Force locking on a new server.
+    }
+    int i;
+    for (i = 0; i < StreamsCount; ++i) {
+        Streams[i].pending = 0;
+        Streams[i].streaming = 0;
+    }
+    if (!locked) return;
+
+    if (HouseFeedStandbyServer) {
+        housemech_feed_failover ();
+    } else if (!HouseFeedBlindSince) {
+        HouseFeedBlindSince = time(0);
+    }
+}
+
+static ParserToken *housemech_feed_prepare (int count) {
+
+    static ParserToken *FeedTokens = 0;
+    static int FeedTokensAllocated = 0;
+
+    // Give back the memory used for a large catch up once it is over.
+    int shrink = (FeedTokensAllocated > 4096) &&
+                 (count + 128 < FeedTokensAllocated / 4);
+
+    if ((count > FeedTokensAllocated) || shrink) {
+        int need = FeedTokensAllocated = count + 128;
+        FeedTokens = realloc (FeedTokens, need*sizeof(ParserToken));
+        if (!FeedTokens) {
+            houselog_trace (HOUSE_FAILURE, "FEED", "no more memory");
+            exit (1);
+        }
+    }
+    return FeedTokens;
+}
+
+static void housemech_feed_response
+                (void *origin, int status, char *data, int length) {
+
+    HouseFeedRoute *route = (HouseFeedRoute *)origin;
+    HouseFeedStream *stream = Streams + route->stream;
+    const char *provider = route->provider;
+
+    if (HouseFeedCurrentServer && strcmp (provider, HouseFeedCurrentServer))
+        return; // Not the server that this service is locked on.
+
+    status = echttp_redirected("GET");
+    if (!status) {
+        echttp_submit (0, 0, housemech_feed_response, origin);
+        return;
+    }
+
+    int held = 0;
+    int elapsed = 0;
+    int waited = (stream->pending != 0);
+    if (waited) {
+        // This was a long poll. If the server held it until the wait
+        // period expired, it does support long polls and a new one can
+        // be issued right away. Otherwise fall back to periodic polling.
+        //
+        elapsed = (int)(time(0) - stream->pending);
+        held = (elapsed >= stream->wait / 2);
+        stream->pending = 0;
+    }
+
+    if (status == 304) goto nochange;
+
+    if ((status != 200) && held) {
+        // A long poll that fails after being held that long was most
+        // likely abandoned by the HTTP client (timeout), not by the server:
+        // this is not a reason to unlock. Shorten the wait period to stay
+        // under that timeout. If the server really hangs, the wait period
+        // shrinks to nothing and the next failure unlocks as usual.
+        //
+        stream->wait = (elapsed * 2) / 3;
+        stream->streaming = 0;
+        houselog_trace (HOUSE_FAILURE, provider,
+                        "%s long poll failed after %d seconds (HTTP code %d),"
+                        " wait now %d seconds",
+                        stream->name, elapsed, status, stream->wait);
+        return;
+    }
+
+    if (status != 200) {
+        houselog_trace (HOUSE_FAILURE, provider, "HTTP code %d", status);
+        goto failure;
+    }
+
+    int count = echttp_json_estimate(data);
+    ParserToken *tokens = housemech_feed_prepare (count);
+
+    const char *error = echttp_json_parse (data, tokens, &count);
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, provider, "syntax error, %s", error);
+        goto failure;
+    }
+    if (count <= 0) {
+        houselog_trace (HOUSE_FAILURE, provider, "no data");
+        goto failure;
+    }
+
+    int server = echttp_json_search (tokens, ".host");
+    if (server < 0) {
+        houselog_trace (HOUSE_FAILURE, provider, "No host name");
+        goto failure;
+    }
+
+    int latest = echttp_json_search (tokens, ".saga.latest");
+    if (latest < 0) {
+        houselog_trace (HOUSE_FAILURE, provider, "No latest ID");
+        goto failure;
+    }
+    long long latestvalue = tokens[latest].value.integer;
+
+    if (!HouseFeedCurrentServer) {
+        housemech_feed_lock (provider);
+    } else {
+        if (stream->known == latestvalue) goto nochange;
+        if (stream->latestid > latestvalue) {
+            // This should never happen, except if the server restarted.
+            // In that case, look at everything: this is all new.
+            stream->latestid = 0;
+            stream->order = 0;
+        }
+        DEBUG ("Detected new %s from %s\n", stream->name, provider);
+    }
+    int records = echttp_json_search (tokens, stream->list);
+    int n = (records < 0) ? 0 : tokens[records].length;
+    int more = 0;
+
+    if (n > 0) {
+        int queued = 0;
+        long long latesttime = 0;
+
+        int *list = calloc (n, sizeof(int));
+        const char *error = echttp_json_enumerate (tokens+records, list, n);
+        int full = (stream->limit > 0) && (n >= stream->limit);
+        stream->unpaged = 0;
+
+        // A server that pages oldest first answers the probe (limit=1)
+        // with the oldest record of the page being verified, while a server
+        // that pages newest first answers with its latest record.
+        //
+        HouseMechSagaRecord oldest;
+        if (stream->probing) {
+            long long probing = stream->probing;
+            stream->probing = 0;
+            if ((!error) &&
+                housemech_saga_decode (tokens + records + list[n-1], &oldest) &&
+                (oldest.id == probing)) {
+                DEBUG ("History source %s pages oldest first\n", provider);
+                stream->order = 1;
+            } else {
+                DEBUG ("History source %s pages newest first\n", provider);
+                stream->order = -1;
+                free (list);
+                stream->unpaged = 1;
+                housemech_feed_query (route->stream, provider);
+                return;
+            }
+        }
+
+        // Check that no record was left out between the latest record
+        // processed and this page (the list is newest first). An ID gap
+        // is not a proof by itself, since a server might skip IDs: the
+        // first time, the server's paging order is verified. Nothing can
+        // be checked if the latest record processed is not known (new
+        // server): that page is accepted as it is.
+        //
+        if ((!error) && full && (stream->latestid > 0) &&
+            (stream->order <= 0) &&
+            housemech_saga_decode (tokens + records + list[n-1], &oldest) &&
+            (oldest.id > stream->latestid + 1)) {
+            free (list);
+            if (stream->order < 0) {
+                DEBUG ("Gap before %s ID %lld from %s: "
+                       "fetching without limit\n",
+                       stream->name, oldest.id, provider);
+                stream->unpaged = 1;
+            } else {
+                DEBUG ("Gap before %s ID %lld from %s: "
+                       "checking the paging order\n",
+                       stream->name, oldest.id, provider);
+                stream->probing = oldest.id;
+            }
+            housemech_feed_query (route->stream, provider);
+            return;
+        }
+        if (!error) {
+            int i;
+            for (i = n - 1; i >= 0; --i) {
+                HouseMechSagaRecord record;
+                if (!housemech_saga_decode (tokens + records + list[i],
+                                            &record)) continue;
+
+                // Avoid processing the same record multiple times.
+                // The ID is always incrementing, even when the record
+                // times are out of sequence (which should be rare).
+                //
+                if (record.id <= stream->latestid) continue;
+
+                // When the queue is full, leave the remaining records
+                // for later: the watermarks do not move past them.
+                if (!housemech_feed_enqueue (route->stream, &record)) {
+                    QueueDeferred += 1;
+                    more = 1;
+                    break;
+                }
+                stream->latestid = record.id;
+                if (record.timestamp > latesttime)
+                    latesttime = record.timestamp;
+                HouseFeedActivity = 1;
+                queued += 1;
+            }
+        }
+        // A full page means that there might be more records waiting,
+        // unless the page only contained records that were already known.
+        if (full && (queued > 0)) more = 1;
+
+        // Move the since parameter forward, but be lenient in the case
+        // records are listed out of order. (Rare, but could happen.)
+        if (latesttime - 5 > stream->latesttime) {
+            stream->latesttime = latesttime - 5;
+        }
+        if (latesttime > stream->lasttime) stream->lasttime = latesttime;
+        free (list);
+
+        DEBUG ("New latest queued %s ID %lld from %s\n",
+               stream->name, stream->latestid, provider);
+
+        housemech_feed_process ();
+    }
+
+    // If some records were left on the server (partial page or full queue),
+    // do not consider the server's latest ID as known yet, otherwise the
+    // remaining records would be seen as "no change".
+    //
+    stream->known = more ? stream->latestid : latestvalue;
+
+    // A long poll held until a new record arrived also shows that
+    // the server supports long polls.
+    if (held) stream->streaming = 1;
+
+    // Request the next page, or else if the server supports long polls,
+    // wait for the next record now. This is delayed if the queue is too
+    // full: the periodic cycle will request more records once the queue
+    // has been drained.
+    //
+    if (housemech_feed_congested ()) {
+        stream->streaming = 0;
+    } else if (more || stream->streaming) {
+        housemech_feed_query (route->stream, provider);
+    }
+    return;
+
+nochange:
+
+    if (!HouseFeedCurrentServer) return; // Nothing to wait for.
+    if (waited) stream->streaming = held;
+    if (stream->streaming) housemech_feed_query (route->stream, provider);
+    return;
+
+failure:
+
+    housemech_feed_unlock ();
+}
+
+static int housemech_feed_query (int stream, const char *provider) {
+
+    char url[1024];
+    HouseFeedStream *s = Streams + stream;
+    int longpoll = (HouseFeedCurrentServer && (s->wait > 0));
+
+    int cursor = snprintf (url, sizeof(url), "%s%s?since=%lld",
+                           provider, s->path, s->latesttime);
+    if (HouseFeedCurrentServer) {
+        cursor += snprintf (url+cursor, sizeof(url)-cursor,
+                            "&known=%lld", s->known);
+    }
+    s->limit = 0;
+    if ((HouseFeedPage > 0) && (!s->unpaged)) {
+        s->limit = s->probing ? 1 : HouseFeedPage;
+        cursor += snprintf (url+cursor, sizeof(url)-cursor,
+                            "&limit=%d", s->limit);
+    }
+    if (longpoll) {
+        snprintf (url+cursor, sizeof(url)-cursor, "&wait=%d", s->wait);
+    }
+
+    const char *error = echttp_client ("GET", url);
+    if (error) {
+        housemech_feed_unlock ();
+        return 0;
+    }
+
+    echttp_submit (0, 0, housemech_feed_response,
+                   (void *)housemech_feed_route (stream, provider));
+    if (longpoll) s->pending = time(0);
+    return 1;
+}
+
+static void housemech_feed_standby_response
+                (void *origin, int status, char *data, int length) {
+
+    HouseFeedRoute *route = (HouseFeedRoute *)origin;
+    HouseFeedStream *stream = Streams + route->stream;
+    const char *provider = route->provider;
+
+    if ((!HouseFeedStandbyServer) || strcmp (provider, HouseFeedStandbyServer))
+        return; // Not the current standby server.
+
+    status = echttp_redirected("GET");
+    if (!status) {
+        echttp_submit (0, 0, housemech_feed_standby_response, origin);
+        return;
+    }
+
+    if (status != 200) {
+        houselog_trace (HOUSE_FAILURE, provider, "HTTP code %d", status);
+        goto failure;
+    }
+
+    int count = echttp_json_estimate(data);
+    ParserToken *tokens = housemech_feed_prepare (count);
+
+    const char *error = echttp_json_parse (data, tokens, &count);
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, provider, "syntax error, %s", error);
+        goto failure;
+    }
+    if (count <= 0) {
+        houselog_trace (HOUSE_FAILURE, provider, "no data");
+        goto failure;
+    }
+
+    int latest = echttp_json_search (tokens, ".saga.latest");
+    if (latest < 0) {
+        houselog_trace (HOUSE_FAILURE, provider, "No latest ID");
+        goto failure;
+    }
+    if (stream->standbyid > tokens[latest].value.integer) {
+        stream->standbyid = 0; // The standby server restarted.
+    }
+
+    // Find the standby's ID of the latest record that was already
+    // processed from the locked server.
+    //
+    int records = echttp_json_search (tokens, stream->list);
+    int n = (records < 0) ? 0 : tokens[records].length;
+    if (n <= 0) return;
+
+    int *list = calloc (n, sizeof(int));
+    error = echttp_json_enumerate (tokens+records, list, n);
+    if (!error) {
+        int i;
+        for (i = 0; i < n; ++i) {
+            HouseMechSagaRecord record;
+            if (!housemech_saga_decode (tokens + records + list[i],
+                                        &record)) continue;
+            if (record.timestamp > stream->lasttime) continue;
+            if (record.id > stream->standbyid) stream->standbyid = record.id;
+        }
+    }
+    free (list);
+    return;
+
+failure:
+
+    housemech_feed_forget_standby ();
+}
+
+static int HouseFeedStandbyDue = 0;
+
+static void housemech_feed_track (const char *provider) {
+
+    if (!HouseFeedStandbyDue) return; // Not at every poll: this is a backup.
+
+    if (!HouseFeedStandbyServer) {
+        DEBUG ("Tracking standby history source %s\n", provider);
+        HouseFeedStandbyServer = strdup (provider);
+    } else if (strcmp (provider, HouseFeedStandbyServer)) {
+        return; // Only one standby server is needed.
+    }
+    HouseFeedStandbySeen = 1;
+
+    int i;
+    for (i = 0; i < StreamsCount; ++i) {
+        HouseFeedStream *stream = Streams + i;
+        char url[1024];
+        int cursor = snprintf (url, sizeof(url), "%s%s?since=%lld",
+                               provider, stream->path, stream->latesttime);
+        if (HouseFeedPage > 0) {
+            snprintf (url+cursor, sizeof(url)-cursor,
+                      "&limit=%d", HouseFeedPage);
+        }
+
+        const char *error = echttp_client ("GET", url);
+        if (error) {
+            housemech_feed_forget_standby ();
+            return;
+        }
+        echttp_submit (0, 0, housemech_feed_standby_response,
+                       (void *)housemech_feed_route (i, provider));
+    }
+}
+
+static int HouseFeedProviderCount = 0;
+
+static void housemech_feed_check
+                (const char *service, void *context, const char *provider) {
+
+    if (HouseFeedCurrentServer && strcmp (provider, HouseFeedCurrentServer)) {
+        housemech_feed_track (provider);
+        return;
+    }
+
+    HouseFeedProviderCount += 1;
+
+    if (housemech_feed_congested ()) return; // Backpressure.
+
+    int i;
+    for (i = 0; i < StreamsCount; ++i) {
+        if (Streams[i].pending) continue; // Long poll still outstanding.
+        if (!housemech_feed_query (i, provider)) return;
+    }
+}
+
+static void housemech_feed_adapt (void) {
+
+    if (!HouseFeedCurrentServer) {
+        HouseFeedPeriod = HOUSE_FEED_CYCLE * 1000;
+    } else if (HouseFeedActivity) {
+        HouseFeedPeriod = HouseFeedFloor;
+    } else {
+        HouseFeedPeriod += HouseFeedPeriod / 2;
+        if (HouseFeedPeriod > HouseFeedCeiling)
+            HouseFeedPeriod = HouseFeedCeiling;
+    }
+    HouseFeedActivity = 0;
+}
+
+static void housemech_feed_poll (void *context) {
+
+    static time_t NextStandbyCycle = 0;
+    time_t now = time(0);
+
+    housemech_feed_sync (now);
+
+    housemech_feed_adapt ();
+    housemech_timer_start (HouseFeedPeriod, housemech_feed_poll, 0);
+
+    if ((! housemech_rule_ready()) || (! housemech_control_ready())) {
+        DEBUG ("Not ready for processing new records yet.\n");
+        return;
+    }
+
+    HouseFeedStandbyDue = (now >= NextStandbyCycle);
+    if (HouseFeedStandbyDue) NextStandbyCycle = now + HOUSE_FEED_CYCLE;
+
+    int i;
+    for (i = 0; i < StreamsCount; ++i) {
+        HouseFeedStream *stream = Streams + i;
+        if (!stream->pending) continue;
+        if (now < stream->pending + stream->wait + HOUSE_FEED_CYCLE) continue;
+        DEBUG ("Long poll for %s on %s timed out\n",
+               stream->name, HouseFeedCurrentServer);
+        stream->pending = 0;
+        stream->streaming = 0;
+    }
+
+    HouseFeedProviderCount = 0;
+    HouseFeedStandbySeen = 0;
+    housediscovered ("history", 0, housemech_feed_check);
+
+    if (HouseFeedStandbyDue && HouseFeedStandbyServer && !HouseFeedStandbySeen) {
+        // The standby server is no longer operating.
+        housemech_feed_forget_standby ();
+    }
+
+    if (HouseFeedProviderCount == 0) {
+        // The server this is locked on is no longer operating.
+        housemech_feed_unlock (); // Will fail over or lock on a new server.
+    }
+}
+
+int housemech_feed_status (char *buffer, int size) {
+
+    int i;
+    int cursor;
+    const char *prefix = "";
+
+    cursor = snprintf (buffer, size, ",\"feed\":{");
+    if (cursor >= size) goto overflow;
+
+    if (HouseFeedCurrentServer) {
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "\"server\":\"%s\",", HouseFeedCurrentServer);
+        if (cursor >= size) goto overflow;
+    }
+    if (HouseFeedStandbyServer) {
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "\"standby\":\"%s\",", HouseFeedStandbyServer);
+        if (cursor >= size) goto overflow;
+    }
+
+    long long blind = HouseFeedBlindTime;
+    if (HouseFeedBlindSince) blind += time(0) - HouseFeedBlindSince;
+    cursor += snprintf (buffer+cursor, size-cursor,
+                        "\"failovers\":%d,\"blind\":%lld,\"period\":%d",
+                        HouseFeedFailovers, blind, HouseFeedPeriod);
+    if (cursor >= size) goto overflow;
+
+    cursor += snprintf (buffer+cursor, size-cursor,
+                        ",\"queue\":{\"size\":%d,\"depth\":%d,\"highest\":%d"
+                        ",\"dropped\":%lld,\"deferred\":%lld,\"stalled\":%lld}",
+                        QueueSize, QueueDepth, QueueHighest,
+                        QueueDropped, QueueDeferred, QueueStalled);
+    if (cursor >= size) goto overflow;
+
+    cursor += snprintf (buffer+cursor, size-cursor, ",\"streams\":{");
+    if (cursor >= size) goto overflow;
+
+    for (i = 0; i < StreamsCount; ++i) {
+        HouseFeedStream *stream = Streams + i;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s\"%s\":{\"since\":%lld,\"latest\":%lld"
+                            ",\"longpoll\":%s,\"wait\":%d}",
+                            prefix, stream->name,
+                            stream->latesttime, stream->latestid,
+                            stream->streaming?"true":"false", stream->wait);
+        if (cursor >= size) goto overflow;
+        prefix = ",";
+    }
+
+    cursor += snprintf (buffer+cursor, size-cursor, "}}");
+    if (cursor >= size) goto overflow;
+
+    return cursor;
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "STATUS",
+                    "BUFFER TOO SMALL (NEED %d bytes)", cursor);
+    buffer[0] = 0;
+    return 0;
+}
@@ -0,0 +1,32 @@
+/* HouseMech - a web server for home automation
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemech_feed.h - Fetch new records from HouseSaga.
+ */
+typedef int housemech_feed_handler (const HouseMechSagaRecord *record);
+
+void housemech_feed_initialize (int argc, const char **argv);
+
+int  housemech_feed_register (const char *name,
+                              const char *path, const char *list,
+                              int wait, housemech_feed_handler *handler);
+
+int  housemech_feed_status (char *buffer, int size);
+
@@ -0,0 +1,301 @@
+/* HouseMech - A simple home web service to automate actions.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemech_profile.c - Measure the cost of the rules.
+ *
+ * SYNOPSYS:
+ *
+ * This module accumulates the number of calls, the number of failures
+ * and the execution time of each trigger proc, and for each kind of
+ * trigger (the proc name prefix: EVENT, SENSOR, POINT, TIME, etc).
+ * The execution times are also accumulated in a log2 histogram, in
+ * microseconds: bucket 0 counts the calls that took less than 1us, and
+ * bucket N the calls that took 2^(N-1) to 2^N us.
+ *
+ * The profiles are shared by all threads: a profile is never freed, so
+ * that its address remains valid, and it is updated using atomic
+ * operations. The recording costs two clock reads and a few atomic
+ * increments per call, which is cheap enough to always be active.
+ *
+ * HouseMechProfile *housemech_profile_get (const char *name);
+ *
+ *    Return the profile for the specified proc, creating it if needed.
+ *    The profile is linked to the profile of its kind.
+ *
+ * long long housemech_profile_start (void);
+ *
+ *    Return the current time, to be used as the start of a call.
+ *
+ * void housemech_profile_record (HouseMechProfile *profile,
+ *                                long long start, int failed);
+ *
+ *    Record the end of a call, started at the specified time.
+ *
+ * int housemech_profile_status (char *buffer, int size);
+ *
+ *    Return the profiles of each kind of trigger in JSON format.
+ *
+ * int housemech_profile_details (char *buffer, int size);
+ *
+ *    Return the profiles of each kind of trigger and of each proc
+ *    in JSON format.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <tcl.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+
+#include "housemech_profile.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_PROFILE_BUCKETS 24 // Up to 8 seconds and more.
+#define HOUSE_PROFILE_KINDS   8
+
+struct HouseMechProfileStruct {
+    const char *name;
+    atomic_llong count;
+    atomic_llong failures;
+    atomic_llong total; // us.
+    atomic_llong max;   // us.
+    atomic_llong histogram[HOUSE_PROFILE_BUCKETS];
+    struct HouseMechProfileStruct *kind;
+};
+
+static pthread_mutex_t HouseProfileLock = PTHREAD_MUTEX_INITIALIZER;
+
+static Tcl_HashTable HouseProfiles;
+static int HouseProfilesInitialized = 0;
+
+static HouseMechProfile *HouseProfileKinds[HOUSE_PROFILE_KINDS];
+static int HouseProfileKindsCount = 0;
+
+static HouseMechProfile *housemech_profile_new (const char *name) {
+    HouseMechProfile *profile = calloc (1, sizeof(HouseMechProfile));
+    profile->name = strdup (name);
+    return profile;
+}
+
+static HouseMechProfile *housemech_profile_kind (const char *name) {
+
+    int i;
+    char kind[32];
+    const char *dot = strchr (name, '.');
+    int length = dot ? (dot - name) : strlen(name);
+    if (length >= sizeof(kind)) length = sizeof(kind) - 1;
+    memcpy (kind, name, length);
+    kind[length] = 0;
+
+    for (i = 0; i < HouseProfileKindsCount; ++i) {
+        if (!strcmp (kind, HouseProfileKinds[i]->name))
+            return HouseProfileKinds[i];
+    }
+    if (HouseProfileKindsCount >= HOUSE_PROFILE_KINDS) return 0;
+
+    HouseMechProfile *profile = housemech_profile_new (kind);
+    HouseProfileKinds[HouseProfileKindsCount++] = profile;
+    return profile;
+}
+
+HouseMechProfile *housemech_profile_get (const char *name) {
+
+    int isnew;
+    HouseMechProfile *profile;
+
+    pthread_mutex_lock (&HouseProfileLock);
+    if (!HouseProfilesInitialized) {
+        Tcl_InitHashTable (&HouseProfiles, TCL_STRING_KEYS);
+        HouseProfilesInitialized = 1;
+    }
+    Tcl_HashEntry *entry = Tcl_CreateHashEntry (&HouseProfiles, name, &isnew);
+    if (isnew) {
+        profile = housemech_profile_new (name);
+        profile->kind = housemech_profile_kind (name);
+        Tcl_SetHashValue (entry, profile);
+    } else {
+        profile = (HouseMechProfile *)Tcl_GetHashValue (entry);
+    }
+    pthread_mutex_unlock (&HouseProfileLock);
+    return profile;
+}
+
+long long housemech_profile_start (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static void housemech_profile_add (HouseMechProfile *profile,
+                                   long long duration, int bucket, int failed) {
+
+    atomic_fetch_add_explicit (&profile->count, 1, memory_order_relaxed);
+    if (failed)
+        atomic_fetch_add_explicit (&profile->failures, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit (&profile->total, duration, memory_order_relaxed);
+    atomic_fetch_add_explicit (&profile->histogram[bucket],
+                               1, memory_order_relaxed);
+
+    long long max = atomic_load_explicit (&profile->max, memory_order_relaxed);
+    while (duration > max) {
+        if (atomic_compare_exchange_weak_explicit
+                (&profile->max, &max, duration,
+                 memory_order_relaxed, memory_order_relaxed)) break;
+    }
+}
+
+void housemech_profile_record (HouseMechProfile *profile,
+                               long long start, int failed) {
+
+    if (!profile) return;
+
+    long long duration = housemech_profile_start() - start;
+    if (duration < 0) duration = 0;
+
+    int bucket = duration ? (64 - __builtin_clzll (duration)) : 0;
+    if (bucket >= HOUSE_PROFILE_BUCKETS) bucket = HOUSE_PROFILE_BUCKETS - 1;
+
+    housemech_profile_add (profile, duration, bucket, failed);
+    if (profile->kind)
+        housemech_profile_add (profile->kind, duration, bucket, failed);
+}
+
+static int housemech_profile_format (char *buffer, int size,
+                                     const char *prefix,
+                                     HouseMechProfile *profile) {
+    int i;
+    int last = -1;
+    long long histogram[HOUSE_PROFILE_BUCKETS];
+
+    for (i = 0; i < HOUSE_PROFILE_BUCKETS; ++i) {
+        histogram[i] = atomic_load_explicit (&profile->histogram[i],
+                                             memory_order_relaxed);
+        if (histogram[i]) last = i;
+    }
+
+    int cursor = snprintf (buffer, size,
+                           "%s\"%s\":{\"count\":%lld,\"failures\":%lld"
+                           ",\"total\":%lld,\"max\":%lld,\"histogram\":[",
+                           prefix, profile->name,
+                           (long long)atomic_load (&profile->count),
+                           (long long)atomic_load (&profile->failures),
+                           (long long)atomic_load (&profile->total),
+                           (long long)atomic_load (&profile->max));
+    if (cursor >= size) return cursor;
+
+    // Omit the trailing empty buckets.
+    for (i = 0; i <= last; ++i) {
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s%lld", i?",":"", histogram[i]);
+        if (cursor >= size) return cursor;
+    }
+    cursor += snprintf (buffer+cursor, size-cursor, "]}");
+    return cursor;
+}
+
+static int housemech_profile_kinds (char *buffer, int size) {
+
+    int i;
+    const char *prefix = "";
+
+    int cursor = snprintf (buffer, size, "\"kinds\":{");
+    if (cursor >= size) return cursor;
+
+    for (i = 0; i < HouseProfileKindsCount; ++i) {
+        cursor += housemech_profile_format (buffer+cursor, size-cursor,
+                                            prefix, HouseProfileKinds[i]);
+        if (cursor >= size) return cursor;
+        prefix = ",";
+    }
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    return cursor;
+}
+
+int housemech_profile_status (char *buffer, int size) {
+
+    int cursor = snprintf (buffer, size, ",\"profile\":{");
+    if (cursor >= size) goto overflow;
+
+    pthread_mutex_lock (&HouseProfileLock);
+    cursor += housemech_profile_kinds (buffer+cursor, size-cursor);
+    pthread_mutex_unlock (&HouseProfileLock);
+    if (cursor >= size) goto overflow;
+
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) goto overflow;
+
+    return cursor;
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "STATUS",
+                    "BUFFER TOO SMALL (NEED %d bytes)", cursor);
+    buffer[0] = 0;
+    return 0;
+}
+
+int housemech_profile_details (char *buffer, int size) {
+
+    const char *prefix = "";
+    Tcl_HashEntry *entry;
+    Tcl_HashSearch search;
+
+    int cursor = snprintf (buffer, size, ",\"profile\":{");
+    if (cursor >= size) goto overflow;
+
+    pthread_mutex_lock (&HouseProfileLock);
+    cursor += housemech_profile_kinds (buffer+cursor, size-cursor);
+    if (cursor >= size) goto unlock;
+
+    cursor += snprintf (buffer+cursor, size-cursor, ",\"procs\":{");
+    if (cursor >= size) goto unlock;
+
+    if (HouseProfilesInitialized) {
+        for (entry = Tcl_FirstHashEntry (&HouseProfiles, &search);
+             entry; entry = Tcl_NextHashEntry (&search)) {
+            HouseMechProfile *profile =
+                (HouseMechProfile *)Tcl_GetHashValue (entry);
+            cursor += housemech_profile_format (buffer+cursor, size-cursor,
+                                                prefix, profile);
+            if (cursor >= size) goto unlock;
+            prefix = ",";
+        }
+    }
+    pthread_mutex_unlock (&HouseProfileLock);
+
+    cursor += snprintf (buffer+cursor, size-cursor, "}}");
+    if (cursor >= size) goto overflow;
+
+    return cursor;
+
+unlock:
+    pthread_mutex_unlock (&HouseProfileLock);
+overflow:
+    houselog_trace (HOUSE_FAILURE, "PROFILE",
+                    "BUFFER TOO SMALL (NEED %d bytes)", cursor);
+    buffer[0] = 0;
+    return 0;
+}
@@ -48,13 +48,53 @@
  *
  * int housemech_rule_trigger_control (const char *name, const char *state);
  *
- *    Process all the rule matching the specified change.
+ *    Process all the rule matching the specified change. Return 1 if a
+ *    trigger was executed (or queued for a worker thread), 0 if no trigger
+ *    was executed. The event and sensor functions return -1 if the worker
+ *    thread is too far behind: the change was ignored, and must be
+ *    submitted again later.
+ *
+ * The names of the trigger procs (EVENT.*, SENSOR.*, POINT.* and TIME.*)
+ * are indexed each time a script is loaded, so that a change that matches
+ * no trigger is ignored without calling the Tcl interpreter.
+ *
+ * Each indexed proc keeps a command object, and the recurring strings
+ * passed as arguments are interned as Tcl objects: a trigger is invoked
+ * through Tcl_EvalObjv, without building and parsing a command string.
+ *
+ * The latest action of each event is recorded by the housemech_state
+ * module, and made available to the rules through House::event.
+ *
+ * The rules may schedule scripts using House::after and House::every,
+ * with a millisecond resolution, based on the housemech_timer module.
+ * A pending rule timer costs nothing until its deadline.
+ *
+ * The schedule triggers (TIME.*) are executed at a time of day, either
+ * a clock time or relative to sunset or sunrise.
+ *
+ * Each trigger, or timer script, is executed under a time budget (and an
+ * optional command budget) using the Tcl interpreter limits. A trigger
+ * that overruns its budget too many times is disabled until the script
+ * is reloaded.
+ *
+ * A new script is loaded in a fresh interpreter, which replaces the
+ * current one only if successful. If only proc definitions changed, the
+ * changed procs are redefined in the current interpreter instead.
+ *
+ * The cost of each trigger proc is measured, see housemech_profile.c.
+ *
+ * With the -rule-workers=N option, the event and sensor triggers are
+ * executed by worker threads, each with its own Tcl interpreter loaded
+ * with the same script. See housemech_worker.c.
  */
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <time.h>
 #include <unistd.h>
 #include <tcl.h>
@@ -67,23 +107,74 @@
 #include "housealmanac.h"
 #include "housecapture.h"
 
+#include "housemech_timer.h"
 #include "housemech_control.h"
+#include "housemech_state.h"
+#include "housemech_worker.h"
+#include "housemech_profile.h"
 #include "housemech_rule.h"
 
 #define DEBUG if (echttp_isdebug()) printf
 
+// The capture is not thread safe: it is only used from the main thread.
+#define CAPTURE if (!housemech_worker_self()) housecapture_record
+
 #define HOUSE_TCL_CYCLE      1
 
 static int HouseMechReady = 0;
 
-static Tcl_Interp *HouseMechInterpreter = 0;
+// The Tcl environment is per thread when worker threads are used, see
+// housemech_worker.c.
+//
+static __thread Tcl_Interp *HouseMechInterpreter = 0;
 
 static const char *HouseMechBoot = "/usr/local/share/house/mech/bootstrap.tcl";
 static const char *HouseMechScript = "mechrules.tcl";
 
+// The trigger procs are indexed by name.
+//
+typedef struct {
+    Tcl_Obj *command;
+    HouseMechProfile *profile;
+    int overruns;
+    int disabled;
+} HouseMechTrigger;
+
+static __thread Tcl_HashTable HouseMechTriggers;
+
+// A script is loaded in a fresh interpreter, which replaces the current
+// one only if the whole script was loaded successfully. The timers created
+// while loading a script belong to that script's generation.
+//
+static __thread int HouseMechLoading = 0;
+static int HouseMechGeneration = 0;
+
+// The outline of the loaded script: the text of each top-level proc
+// definition, by name, and the text of all the other top-level commands.
+// A new script that only differs from the loaded one in its procs is
+// applied to the current interpreter, proc by proc.
+//
+typedef struct {
+    Tcl_HashTable procs;
+    Tcl_DString statements;
+} HouseMechOutline;
+
+static __thread HouseMechOutline *HouseMechLoaded = 0;
+
+#define HOUSE_RULE_TIME_BUDGET 1000 // ms
+#define HOUSE_RULE_STRIKES     3
+
+// The interned strings are never freed, so their count is capped in case
+// some names are not recurring after all.
+//
+#define HOUSE_RULE_INTERN_MAX 4096
+
+static __thread Tcl_HashTable HouseMechStrings;
+
 static int ControlCapture = -1;
 static int SensorCapture = -1;
 static int EventCapture = -1;
+static int TimeCapture = -1;
 
 static int housemech_rule_event_cmd (ClientData clientData,
                                      Tcl_Interp *interp,
@@ -99,7 +190,52 @@ static int housemech_rule_event_cmd (ClientData clientData,
     const char *action = Tcl_GetString (objv[3]);
     const char *text = (objc > 4) ? Tcl_GetString (objv[4]) : "";
 
-    houselog_event (category, name, action, text);
+    houselog_event (category, name, action, "%s", text);
+    return TCL_OK;
+}
+
+// House::event state <category> <name> [<action>]
+// House::event time <category> <name>
+// House::event count <category> <name>
+// House::event new <category> <name> <action> [<description>]
+//
+static int housemech_rule_state_cmd (ClientData clientData,
+                                     Tcl_Interp *interp,
+                                     int objc,
+                                     Tcl_Obj *const objv[]) {
+
+    if (objc < 4) {
+        Tcl_SetResult (interp, "missing parameters", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    const char *cmd = Tcl_GetString (objv[1]);
+    const char *category = Tcl_GetString (objv[2]);
+    const char *name = Tcl_GetString (objv[3]);
+    const char *action = (objc > 4) ? Tcl_GetString (objv[4]) : "";
+
+    if (!strcmp ("state", cmd)) {
+        if (action[0]) housemech_state_set (category, name, action);
+        Tcl_SetResult (interp,
+                       (char *)housemech_state_get (category, name),
+                       TCL_VOLATILE);
+
+    } else if (!strcmp ("time", cmd)) {
+        Tcl_SetObjResult (interp,
+            Tcl_NewWideIntObj (housemech_state_time (category, name)));
+
+    } else if (!strcmp ("count", cmd)) {
+        Tcl_SetObjResult (interp,
+            Tcl_NewIntObj (housemech_state_count (category, name)));
+
+    } else if (!strcmp ("new", cmd)) {
+        const char *text = (objc > 5) ? Tcl_GetString (objv[5]) : "";
+        houselog_event (category, name, action, "%s", text);
+        if (action[0]) housemech_state_set (category, name, action);
+
+    } else {
+        Tcl_SetResult (interp, "invalid subcommand", TCL_STATIC);
+        return TCL_ERROR;
+    }
     return TCL_OK;
 }
 
@@ -218,70 +354,836 @@ static int housemech_rule_sunrise_cmd (ClientData clientData,
     return TCL_OK;
 }
 
-static void housemech_rule_listener (const char *name, time_t timestamp,
-                                      const char *data, int length) {
+// Record an event. A worker thread must forward it to the main thread.
+//
+static void housemech_rule_log (const char *category, const char *name,
+                                const char *action, const char *text) {
+
+    if (housemech_worker_self()) {
+        Tcl_Obj *words[5];
+        words[0] = Tcl_NewStringObj ("House::nativeevent", -1);
+        words[1] = Tcl_NewStringObj (category, -1);
+        words[2] = Tcl_NewStringObj (name, -1);
+        words[3] = Tcl_NewStringObj (action, -1);
+        words[4] = Tcl_NewStringObj (text, -1);
+        Tcl_Obj *command = Tcl_NewListObj (5, words);
+        Tcl_IncrRefCount (command);
+        housemech_worker_forward (Tcl_GetString (command), 0, 0);
+        Tcl_DecrRefCount (command);
+        return;
+    }
+    houselog_event (category, name, action, "%s", text);
+}
 
-    houselog_event ("SCRIPT", HouseMechScript, "LOAD", "FROM DEPOT %s", name);
-    Tcl_Eval (HouseMechInterpreter, data);
-    HouseMechReady = 1;
+// Each trigger or timer script is executed under a time budget and,
+// optionally, a command budget, so that a slow or looping script cannot
+// block the service for long. The limits are only set for the outermost
+// evaluation: a nested evaluation runs under the same budget.
+//
+static int HouseMechTimeBudget = HOUSE_RULE_TIME_BUDGET;
+static int HouseMechCommandBudget = 0;
+static int HouseMechStrikes = HOUSE_RULE_STRIKES;
+
+static __thread int HouseMechLimitDepth = 0;
+static atomic_llong HouseMechOverruns = 0;
+
+static void housemech_rule_limit_start (void) {
+
+    if (HouseMechLimitDepth++ > 0) return;
+
+    if (HouseMechTimeBudget > 0) {
+        Tcl_Time deadline;
+        Tcl_GetTime (&deadline);
+        deadline.usec += (HouseMechTimeBudget % 1000) * 1000;
+        deadline.sec += (HouseMechTimeBudget / 1000) + (deadline.usec / 1000000);
+        deadline.usec %= 1000000;
+        Tcl_LimitSetTime (HouseMechInterpreter, &deadline);
+        Tcl_LimitTypeSet (HouseMechInterpreter, TCL_LIMIT_TIME);
+    }
+
+    if (HouseMechCommandBudget > 0) {
+        // The command limit applies to the interpreter's total count.
+        static __thread Tcl_Obj *CmdCount = 0;
+        int count = 0;
+        if (!CmdCount) {
+            CmdCount = Tcl_NewStringObj ("info cmdcount", -1);
+            Tcl_IncrRefCount (CmdCount);
+        }
+        if (Tcl_EvalObjEx (HouseMechInterpreter, CmdCount, 0) == TCL_OK)
+            Tcl_GetIntFromObj (HouseMechInterpreter,
+                               Tcl_GetObjResult (HouseMechInterpreter), &count);
+        Tcl_LimitSetCommands (HouseMechInterpreter,
+                              count + HouseMechCommandBudget);
+        Tcl_LimitTypeSet (HouseMechInterpreter, TCL_LIMIT_COMMANDS);
+    }
 }
 
-void housemech_rule_initialize (int argc, const char **argv) {
+// Remove the limits and return 1 if the script went over its budget.
+//
+static int housemech_rule_limit_end (const char *name) {
 
-    Tcl_FindExecutable (argv[0]);
-    HouseMechInterpreter = Tcl_CreateInterp();
-    if (Tcl_Init(HouseMechInterpreter) != TCL_OK) {
+    if (--HouseMechLimitDepth > 0) return 0;
+
+    int overrun = Tcl_LimitExceeded (HouseMechInterpreter);
+    if (overrun) {
+        atomic_fetch_add (&HouseMechOverruns, 1);
+        housemech_rule_log ("SCRIPT", name, "OVERRUN",
+                            Tcl_GetStringResult (HouseMechInterpreter));
+    }
+    Tcl_LimitTypeReset (HouseMechInterpreter, TCL_LIMIT_TIME);
+    Tcl_LimitTypeReset (HouseMechInterpreter, TCL_LIMIT_COMMANDS);
+    return overrun;
+}
+
+// The rule timers (House::after and House::every) are based on the timer
+// module. Each rule timer has its own ID, which does not change when a
+// periodic timer is restarted.
+//
+typedef struct {
+    long long id;
+    long long timer;    // The timer module's ID, 0 when not pending.
+    long long deadline;
+    long long period;   // 0 for a one-shot timer.
+    int overruns;
+    int generation;     // 0 if not created while loading a script.
+    Tcl_Obj *script;
+} HouseMechRuleTimer;
+
+static Tcl_HashTable HouseMechTimers;
+static long long HouseMechTimerNextId = 1;
+
+static long long HouseMechTimerFired = 0;
+static long long HouseMechTimerFailed = 0;
+static long long HouseMechTimerLateMax = 0;
+static long long HouseMechTimerLateTotal = 0;
+
+static Tcl_HashEntry *housemech_rule_timer_search (long long id) {
+    return Tcl_FindHashEntry (&HouseMechTimers, (const char *)(intptr_t)id);
+}
+
+static void housemech_rule_timer_free (Tcl_HashEntry *entry) {
+
+    HouseMechRuleTimer *timer = (HouseMechRuleTimer *)Tcl_GetHashValue (entry);
+
+    if (timer->timer) housemech_timer_cancel (timer->timer);
+    Tcl_DecrRefCount (timer->script);
+    free (timer);
+    Tcl_DeleteHashEntry (entry);
+}
+
+static void housemech_rule_timer_expire (void *context) {
+
+    HouseMechRuleTimer *timer = (HouseMechRuleTimer *)context;
+    long long id = timer->id;
+    Tcl_Obj *script = timer->script;
+
+    long long late = housemech_timer_now() - timer->deadline;
+    if (late > HouseMechTimerLateMax) HouseMechTimerLateMax = late;
+    HouseMechTimerLateTotal += late;
+    HouseMechTimerFired += 1;
+
+    timer->timer = 0;
+
+    // The script may cancel its own timer: keep the script alive, and
+    // do not access the timer again without searching for it.
+    //
+    char name[64];
+    snprintf (name, sizeof(name), "TIMER.%lld", id);
+
+    static HouseMechProfile *Profile = 0;
+    if (!Profile) Profile = housemech_profile_get ("TIMER");
+
+    Tcl_IncrRefCount (script);
+    long long start = housemech_profile_start ();
+    housemech_rule_limit_start ();
+    int status = Tcl_EvalObjEx (HouseMechInterpreter, script, TCL_EVAL_GLOBAL);
+    int overrun = housemech_rule_limit_end (name);
+    housemech_profile_record (Profile, start, status != TCL_OK);
+    if (status != TCL_OK) {
+        HouseMechTimerFailed += 1;
+        DEBUG ("Timer %lld failed: %s\n",
+               id, Tcl_GetStringResult (HouseMechInterpreter));
+    }
+    Tcl_DecrRefCount (script);
+
+    Tcl_HashEntry *entry = housemech_rule_timer_search (id);
+    if (!entry) return;
+
+    if (overrun && (++(timer->overruns) >= HouseMechStrikes)) {
+        houselog_event ("SCRIPT", name, "DISABLED",
+                        "AFTER %d OVERRUNS", timer->overruns);
+        housemech_rule_timer_free (entry);
+        return;
+    }
+
+    if (timer->period <= 0) {
+        housemech_rule_timer_free (entry);
+        return;
+    }
+
+    // Keep a periodic timer in phase, but skip the periods already missed.
+    long long now = housemech_timer_now();
+    timer->deadline += timer->period;
+    if (timer->deadline <= now) timer->deadline = now + timer->period;
+    timer->timer = housemech_timer_start (timer->deadline - now,
+                                          housemech_rule_timer_expire, timer);
+}
+
+// House::after <ms> <script> ...
+// House::every <ms> <script> ...
+//
+static int housemech_rule_after_cmd (ClientData clientData,
+                                     Tcl_Interp *interp,
+                                     int objc,
+                                     Tcl_Obj *const objv[]) {
+
+    int periodic = (clientData != 0);
+    Tcl_WideInt delay;
+
+    if (objc < 3) {
+        Tcl_SetResult (interp, "missing parameters", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if (Tcl_GetWideIntFromObj (interp, objv[1], &delay) != TCL_OK) {
+        Tcl_SetResult (interp, "invalid delay", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if ((delay < 0) || (periodic && (delay == 0))) {
+        Tcl_SetResult (interp, "invalid delay range", TCL_STATIC);
+        return TCL_ERROR;
+    }
+
+    HouseMechRuleTimer *timer = calloc (1, sizeof(HouseMechRuleTimer));
+    timer->id = HouseMechTimerNextId++;
+    timer->generation = HouseMechLoading ? HouseMechGeneration + 1 : 0;
+    timer->period = periodic ? delay : 0;
+    timer->deadline = housemech_timer_now() + delay;
+    timer->script = (objc == 3) ? objv[2] : Tcl_ConcatObj (objc-2, objv+2);
+    Tcl_IncrRefCount (timer->script);
+
+    int isnew;
+    Tcl_HashEntry *entry =
+        Tcl_CreateHashEntry (&HouseMechTimers,
+                             (const char *)(intptr_t)(timer->id), &isnew);
+    Tcl_SetHashValue (entry, timer);
+
+    timer->timer =
+        housemech_timer_start (delay, housemech_rule_timer_expire, timer);
+
+    Tcl_SetObjResult (interp, Tcl_NewWideIntObj (timer->id));
+    return TCL_OK;
+}
+
+// House::cancel <id>
+//
+static int housemech_rule_cancel_cmd (ClientData clientData,
+                                      Tcl_Interp *interp,
+                                      int objc,
+                                      Tcl_Obj *const objv[]) {
+
+    Tcl_WideInt id;
+
+    if (objc < 2) {
+        Tcl_SetResult (interp, "missing parameters", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if (Tcl_GetWideIntFromObj (interp, objv[1], &id) != TCL_OK) {
+        Tcl_SetResult (interp, "invalid timer", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    Tcl_HashEntry *entry = housemech_rule_timer_search (id);
+    if (entry) housemech_rule_timer_free (entry);
+
+    Tcl_SetObjResult (interp, Tcl_NewBooleanObj (entry != 0));
+    return TCL_OK;
+}
+
+// In a worker thread, the House commands are forwarded to the main thread.
+// The commands that only make a change (control set, start and cancel,
+// new events) do not wait for the main thread to execute them.
+//
+static int housemech_rule_proxy_cmd (ClientData clientData,
+                                     Tcl_Interp *interp,
+                                     int objc,
+                                     Tcl_Obj *const objv[]) {
+
+    int wait = 1;
+    int query = 0;
+    const char *name = Tcl_GetString (objv[0]);
+    const char *cmd = (objc > 1) ? Tcl_GetString (objv[1]) : "";
+
+    if (!strcmp (name, "House::control")) {
+        query = wait = (!strcmp (cmd, "state"));
+    } else if (!strcmp (name, "House::event")) {
+        wait = strcmp (cmd, "new");
+        query = ((!strcmp (cmd, "state")) && (objc <= 4)) ||
+                (!strcmp (cmd, "time")) || (!strcmp (cmd, "count"));
+    } else if (!strcmp (name, "House::nativeevent")) {
+        wait = 0;
+    } else if ((!strcmp (name, "House::sunset")) ||
+               (!strcmp (name, "House::sunrise"))) {
+        query = 1;
+    }
+
+    // The main thread loads the same script: any change requested while
+    // loading the script in a worker was already done by the main thread.
+    //
+    if (HouseMechLoading && (!query)) return TCL_OK;
+
+    Tcl_Obj *command = Tcl_NewListObj (objc, objv);
+    Tcl_IncrRefCount (command);
+    int status = TCL_OK;
+    char *result =
+        housemech_worker_forward (Tcl_GetString (command), wait, &status);
+    Tcl_DecrRefCount (command);
+
+    if (result) {
+        Tcl_SetObjResult (interp, Tcl_NewStringObj (result, -1));
+        free (result);
+    }
+    return status;
+}
+
+// Cancel the timers created while loading a script, except for the
+// specified generation.
+//
+static void housemech_rule_timer_retire (int keep) {
+
+    Tcl_HashEntry *entry;
+    Tcl_HashSearch search;
+
+    entry = Tcl_FirstHashEntry (&HouseMechTimers, &search);
+    while (entry) {
+        HouseMechRuleTimer *timer =
+            (HouseMechRuleTimer *)Tcl_GetHashValue (entry);
+        Tcl_HashEntry *next = Tcl_NextHashEntry (&search);
+        if (timer->generation && (timer->generation != keep))
+            housemech_rule_timer_free (entry);
+        entry = next;
+    }
+}
+
+static void housemech_rule_schedule (void);
+
+static int housemech_rule_index_add (const char *name) {
+
+    int isnew;
+    Tcl_HashEntry *entry =
+        Tcl_CreateHashEntry (&HouseMechTriggers, name, &isnew);
+    if (!isnew) return 0;
+
+    // A command object caches the resolved proc after its first use.
+    HouseMechTrigger *trigger = calloc (1, sizeof(HouseMechTrigger));
+    trigger->command = Tcl_NewStringObj (name, -1);
+    Tcl_IncrRefCount (trigger->command);
+    trigger->profile = housemech_profile_get (name);
+    Tcl_SetHashValue (entry, trigger);
+    return 1;
+}
+
+static int housemech_rule_index_remove (const char *name) {
+
+    Tcl_HashEntry *entry = Tcl_FindHashEntry (&HouseMechTriggers, name);
+    if (!entry) return 0;
+
+    HouseMechTrigger *trigger = (HouseMechTrigger *)Tcl_GetHashValue (entry);
+    Tcl_DecrRefCount (trigger->command);
+    free (trigger);
+    Tcl_DeleteHashEntry (entry);
+    return 1;
+}
+
+static int housemech_rule_is_trigger (const char *name) {
+
+    return (!strncmp (name, "EVENT.", 6)) || (!strncmp (name, "SENSOR.", 7)) ||
+           (!strncmp (name, "POINT.", 6)) || (!strncmp (name, "TIME.", 5));
+}
+
+static void housemech_rule_index (void) {
+
+    static const char *Patterns[] = {
+        "info procs {EVENT.*}", "info procs {SENSOR.*}",
+        "info procs {POINT.*}", "info procs {TIME.*}"
+    };
+    int i;
+    Tcl_HashEntry *entry;
+    Tcl_HashSearch search;
+
+    for (entry = Tcl_FirstHashEntry (&HouseMechTriggers, &search);
+         entry; entry = Tcl_NextHashEntry (&search)) {
+        HouseMechTrigger *trigger =
+            (HouseMechTrigger *)Tcl_GetHashValue (entry);
+        Tcl_DecrRefCount (trigger->command);
+        free (trigger);
+    }
+    Tcl_DeleteHashTable (&HouseMechTriggers);
+    Tcl_InitHashTable (&HouseMechTriggers, TCL_STRING_KEYS);
+
+    for (i = 0; i < sizeof(Patterns)/sizeof(Patterns[0]); ++i) {
+        if (Tcl_Eval (HouseMechInterpreter, Patterns[i]) != TCL_OK) continue;
+
+        int count;
+        Tcl_Obj **procs;
+        if (Tcl_ListObjGetElements (HouseMechInterpreter,
+                                    Tcl_GetObjResult (HouseMechInterpreter),
+                                    &count, &procs) != TCL_OK) continue;
+        int j;
+        for (j = 0; j < count; ++j) {
+            housemech_rule_index_add (Tcl_GetString (procs[j]));
+        }
+    }
+    DEBUG ("Indexed %d trigger procs\n", HouseMechTriggers.numEntries);
+
+    if (!housemech_worker_self()) housemech_rule_schedule ();
+}
+
+// Create a Tcl interpreter for the current thread, with the House
+// commands. In a worker thread, the House commands are forwarded to the
+// main thread. Return 0 on failure.
+//
+static Tcl_Interp *housemech_rule_interpreter (void) {
+
+    Tcl_Interp *interp = Tcl_CreateInterp();
+    if (Tcl_Init(interp) != TCL_OK) {
         DEBUG ("Cannot create the Tcl interpeter.\n");
-        exit(1);
+        Tcl_DeleteInterp (interp);
+        return 0;
     }
-    if (Tcl_EvalFile (HouseMechInterpreter, HouseMechBoot) != TCL_OK) {
+    if (Tcl_EvalFile (interp, HouseMechBoot) != TCL_OK) {
         DEBUG ("Cannot load %s: %s\n",
-                HouseMechBoot, Tcl_GetStringResult(HouseMechInterpreter));
-        exit(1);
+                HouseMechBoot, Tcl_GetStringResult(interp));
+        Tcl_DeleteInterp (interp);
+        return 0;
+    }
+
+    if (housemech_worker_self()) {
+        static const char *Proxies[] = {
+            "House::control", "House::nativeevent", "House::event",
+            "House::sunset", "House::sunrise",
+            "House::after", "House::every", "House::cancel"
+        };
+        int i;
+        for (i = 0; i < sizeof(Proxies)/sizeof(Proxies[0]); ++i) {
+            Tcl_CreateObjCommand (interp,
+                                  Proxies[i], housemech_rule_proxy_cmd, 0, 0);
+        }
+        return interp;
     }
 
-    Tcl_CreateObjCommand (HouseMechInterpreter,
+    Tcl_CreateObjCommand (interp,
                  "House::control", housemech_rule_control_cmd, 0, 0);
 
-    Tcl_CreateObjCommand (HouseMechInterpreter,
+    Tcl_CreateObjCommand (interp,
                  "House::nativeevent", housemech_rule_event_cmd, 0, 0);
 
-    Tcl_CreateObjCommand (HouseMechInterpreter,
+    Tcl_CreateObjCommand (interp,
+                 "House::event", housemech_rule_state_cmd, 0, 0);
+
+    Tcl_CreateObjCommand (interp,
                  "House::sunset", housemech_rule_sunset_cmd, 0, 0);
 
-    Tcl_CreateObjCommand (HouseMechInterpreter,
+    Tcl_CreateObjCommand (interp,
                  "House::sunrise", housemech_rule_sunrise_cmd, 0, 0);
 
+    Tcl_CreateObjCommand (interp,
+                 "House::after", housemech_rule_after_cmd, 0, 0);
+
+    Tcl_CreateObjCommand (interp,
+                 "House::every", housemech_rule_after_cmd, (ClientData)1, 0);
+
+    Tcl_CreateObjCommand (interp,
+                 "House::cancel", housemech_rule_cancel_cmd, 0, 0);
+
+    return interp;
+}
+
+// Return the name of the proc defined by a top-level command, or 0 if
+// this is not a plain proc definition. All words must be literal, so that
+// the command can be evaluated on its own, and the name must not refer
+// to a namespace, which the script might create.
+//
+static int housemech_rule_outline_proc (Tcl_Parse *parse, Tcl_DString *name) {
+
+    if (parse->numWords != 4) return 0;
+
+    int i;
+    Tcl_Token *words[4];
+    Tcl_Token *token = parse->tokenPtr;
+    for (i = 0; i < 4; ++i) {
+        if (token->type != TCL_TOKEN_SIMPLE_WORD) return 0;
+        words[i] = token + 1;
+        token += token->numComponents + 1;
+    }
+    if ((words[0]->size != 4) || strncmp (words[0]->start, "proc", 4))
+        return 0;
+
+    Tcl_DStringInit (name);
+    Tcl_DStringAppend (name, words[1]->start, words[1]->size);
+    if (strstr (Tcl_DStringValue (name), "::")) {
+        Tcl_DStringFree (name);
+        return 0;
+    }
+    return 1;
+}
+
+static void housemech_rule_outline_free (HouseMechOutline *outline) {
+
+    Tcl_HashEntry *entry;
+    Tcl_HashSearch search;
+
+    if (!outline) return;
+    for (entry = Tcl_FirstHashEntry (&outline->procs, &search);
+         entry; entry = Tcl_NextHashEntry (&search)) {
+        free (Tcl_GetHashValue (entry));
+    }
+    Tcl_DeleteHashTable (&outline->procs);
+    Tcl_DStringFree (&outline->statements);
+    free (outline);
+}
+
+// Split a script into its top-level commands. Return 0 if the script
+// cannot be parsed, or if it defines the same proc twice: this script
+// must then be loaded as a whole.
+//
+static HouseMechOutline *housemech_rule_outline (const char *script) {
+
+    HouseMechOutline *outline = calloc (1, sizeof(HouseMechOutline));
+    Tcl_InitHashTable (&outline->procs, TCL_STRING_KEYS);
+    Tcl_DStringInit (&outline->statements);
+
+    const char *cursor = script;
+    int left = strlen (script);
+
+    while (left > 0) {
+        Tcl_Parse parse;
+        if (Tcl_ParseCommand (0, cursor, left, 0, &parse) != TCL_OK) {
+            housemech_rule_outline_free (outline);
+            return 0;
+        }
+        const char *end = parse.commandStart + parse.commandSize;
+        Tcl_DString name;
+        if (housemech_rule_outline_proc (&parse, &name)) {
+            int isnew;
+            Tcl_HashEntry *entry =
+                Tcl_CreateHashEntry (&outline->procs,
+                                     Tcl_DStringValue (&name), &isnew);
+            Tcl_DStringFree (&name);
+            if (!isnew) {
+                Tcl_FreeParse (&parse);
+                housemech_rule_outline_free (outline);
+                return 0;
+            }
+            Tcl_SetHashValue (entry,
+                              strndup (parse.commandStart, parse.commandSize));
+        } else if (parse.numWords > 0) {
+            Tcl_DStringAppend (&outline->statements,
+                               parse.commandStart, parse.commandSize);
+        }
+        Tcl_FreeParse (&parse);
+        if (end <= cursor) break;
+        left -= (end - cursor);
+        cursor = end;
+    }
+    return outline;
+}
+
+// Apply a new script to the current interpreter, proc by proc: this is
+// only possible if the top-level commands other than proc definitions
+// did not change. The changed procs are first defined in a scratch
+// interpreter, so that the current one is not modified if one fails.
+// Return 0 if the script must be loaded as a whole.
+//
+static int housemech_rule_load_procs (HouseMechOutline *outline) {
+
+    Tcl_HashEntry *entry;
+    Tcl_HashSearch search;
+
+    if ((!HouseMechInterpreter) || (!HouseMechLoaded)) return 0;
+    if (strcmp (Tcl_DStringValue (&outline->statements),
+                Tcl_DStringValue (&HouseMechLoaded->statements))) return 0;
+
+    int changed = 0;
+    Tcl_Interp *scratch = Tcl_CreateInterp ();
+    for (entry = Tcl_FirstHashEntry (&outline->procs, &search);
+         entry; entry = Tcl_NextHashEntry (&search)) {
+        const char *name = Tcl_GetHashKey (&outline->procs, entry);
+        const char *text = (const char *)Tcl_GetHashValue (entry);
+        Tcl_HashEntry *loaded = Tcl_FindHashEntry (&HouseMechLoaded->procs, name);
+        if (loaded && (!strcmp (text, Tcl_GetHashValue (loaded)))) continue;
+        if (Tcl_Eval (scratch, text) != TCL_OK) {
+            Tcl_DeleteInterp (scratch);
+            return 0;
+        }
+        changed += 1;
+    }
+    Tcl_DeleteInterp (scratch);
+
+    int removed = 0;
+    int reindex = 0;
+    for (entry = Tcl_FirstHashEntry (&outline->procs, &search);
+         entry; entry = Tcl_NextHashEntry (&search)) {
+        const char *name = Tcl_GetHashKey (&outline->procs, entry);
+        const char *text = (const char *)Tcl_GetHashValue (entry);
+        Tcl_HashEntry *loaded = Tcl_FindHashEntry (&HouseMechLoaded->procs, name);
+        if (loaded && (!strcmp (text, Tcl_GetHashValue (loaded)))) continue;
+        Tcl_Eval (HouseMechInterpreter, text);
+        if (housemech_rule_is_trigger (name))
+            reindex |= housemech_rule_index_add (name);
+    }
+    for (entry = Tcl_FirstHashEntry (&HouseMechLoaded->procs, &search);
+         entry; entry = Tcl_NextHashEntry (&search)) {
+        const char *name = Tcl_GetHashKey (&HouseMechLoaded->procs, entry);
+        if (Tcl_FindHashEntry (&outline->procs, name)) continue;
+        Tcl_Obj *rename[3];
+        rename[0] = Tcl_NewStringObj ("rename", -1);
+        rename[1] = Tcl_NewStringObj (name, -1);
+        rename[2] = Tcl_NewObj ();
+        int i;
+        for (i = 0; i < 3; ++i) Tcl_IncrRefCount (rename[i]);
+        Tcl_EvalObjv (HouseMechInterpreter, 3, rename, TCL_EVAL_GLOBAL);
+        for (i = 0; i < 3; ++i) Tcl_DecrRefCount (rename[i]);
+        if (housemech_rule_is_trigger (name))
+            reindex |= housemech_rule_index_remove (name);
+        removed += 1;
+    }
+
+    // Reloading the script gives every disabled trigger another chance.
+    for (entry = Tcl_FirstHashEntry (&HouseMechTriggers, &search);
+         entry; entry = Tcl_NextHashEntry (&search)) {
+        HouseMechTrigger *trigger =
+            (HouseMechTrigger *)Tcl_GetHashValue (entry);
+        trigger->overruns = 0;
+        trigger->disabled = 0;
+    }
+    if (reindex && (!housemech_worker_self())) housemech_rule_schedule ();
+
+    DEBUG ("Reloaded %d procs, removed %d procs\n", changed, removed);
+    return 1;
+}
+
+// Load a script into a fresh interpreter, and replace the current
+// interpreter only if the whole script was loaded successfully: the
+// current interpreter is not modified by a failed load, and no proc from
+// the previous script remains after a successful one. The state kept
+// outside of Tcl (event states, control points, pending timers) is not
+// affected, except for the timers created when the previous script was
+// loaded, which the new script is expected to create again.
+//
+// If only proc definitions changed, the new script is applied proc by
+// proc to the current interpreter instead: the other top-level commands
+// are not executed again, and the timers they created are kept.
+//
+static int housemech_rule_load (const char *script) {
+
+    HouseMechOutline *outline = housemech_rule_outline (script);
+    if (outline && housemech_rule_load_procs (outline)) {
+        housemech_rule_outline_free (HouseMechLoaded);
+        HouseMechLoaded = outline;
+        return 1;
+    }
+
+    Tcl_Interp *fresh = housemech_rule_interpreter ();
+    if (!fresh) {
+        housemech_rule_outline_free (outline);
+        return 0;
+    }
+
+    HouseMechLoading = 1;
+    int status = Tcl_Eval (fresh, script);
+    HouseMechLoading = 0;
+
+    if (status != TCL_OK) {
+        char text[256];
+        snprintf (text, sizeof(text), "LINE %d: %s",
+                  Tcl_GetErrorLine (fresh), Tcl_GetStringResult (fresh));
+        housemech_rule_log ("SCRIPT", HouseMechScript, "ERROR", text);
+        Tcl_DeleteInterp (fresh);
+        housemech_rule_outline_free (outline);
+        if (!housemech_worker_self())
+            housemech_rule_timer_retire (HouseMechGeneration);
+        return 0;
+    }
+    housemech_rule_outline_free (HouseMechLoaded);
+    HouseMechLoaded = outline;
+
+    Tcl_Interp *previous = HouseMechInterpreter;
+    HouseMechInterpreter = fresh;
+    housemech_rule_index ();
+    if (previous) Tcl_DeleteInterp (previous);
+
+    if (!housemech_worker_self()) {
+        HouseMechGeneration += 1;
+        housemech_rule_timer_retire (HouseMechGeneration);
+    }
+    return 1;
+}
+
+static void housemech_rule_listener (const char *name, time_t timestamp,
+                                      const char *data, int length) {
+
+    houselog_event ("SCRIPT", HouseMechScript, "LOAD", "FROM DEPOT %s", name);
+    if (!housemech_rule_load (data)) return;
+    housemech_worker_submit (0, 'L', 1, &data);
+    HouseMechReady = 1;
+}
+
+static housemech_worker_start housemech_rule_worker_start;
+static housemech_worker_process housemech_rule_worker_process;
+static housemech_worker_forwarded housemech_rule_worker_forwarded;
+
+void housemech_rule_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *timebudget = 0;
+    const char *commandbudget = 0;
+    const char *strikes = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-rule-time=", argv[i], &timebudget)) continue;
+        if (echttp_option_match ("-rule-commands=", argv[i], &commandbudget))
+            continue;
+        if (echttp_option_match ("-rule-strikes=", argv[i], &strikes)) continue;
+    }
+    if (timebudget) HouseMechTimeBudget = atoi (timebudget);
+    if (commandbudget) HouseMechCommandBudget = atoi (commandbudget);
+    if (strikes) {
+        HouseMechStrikes = atoi (strikes);
+        if (HouseMechStrikes <= 0) HouseMechStrikes = INT_MAX; // Never.
+    }
+
+    Tcl_InitHashTable (&HouseMechTimers, TCL_ONE_WORD_KEYS);
+
+    Tcl_InitHashTable (&HouseMechTriggers, TCL_STRING_KEYS);
+    Tcl_InitHashTable (&HouseMechStrings, TCL_STRING_KEYS);
+
+    Tcl_FindExecutable (argv[0]);
+    HouseMechInterpreter = housemech_rule_interpreter ();
+    if (!HouseMechInterpreter) exit(1);
+
+    housemech_worker_initialize (argc, argv,
+                                 housemech_rule_worker_start,
+                                 housemech_rule_worker_process,
+                                 housemech_rule_worker_forwarded);
+
     housedepositor_subscribe
         ("scripts", HouseMechScript, housemech_rule_listener);
 
     EventCapture = housecapture_register ("EVENT");
     SensorCapture = housecapture_register ("SENSOR");
     ControlCapture = housecapture_register ("CONTROL");
+    TimeCapture = housecapture_register ("TIME");
 }
 
-int housemech_rule_status (char *buffer, int size) {
+// Return a Tcl object for the specified string. Recurring strings are
+// interned, so that the same object is reused from one trigger to the
+// next. The caller must release the object using Tcl_DecrRefCount.
+//
+static Tcl_Obj *housemech_rule_intern (const char *value) {
+
+    Tcl_Obj *object;
+    Tcl_HashEntry *entry = Tcl_FindHashEntry (&HouseMechStrings, value);
 
-    return 0; // TBD
+    if (entry) {
+        object = (Tcl_Obj *)Tcl_GetHashValue (entry);
+    } else {
+        object = Tcl_NewStringObj (value, -1);
+        if (HouseMechStrings.numEntries < HOUSE_RULE_INTERN_MAX) {
+            int isnew;
+            entry = Tcl_CreateHashEntry (&HouseMechStrings, value, &isnew);
+            Tcl_IncrRefCount (object);
+            Tcl_SetHashValue (entry, object);
+        }
+    }
+    Tcl_IncrRefCount (object);
+    return object;
 }
 
-int housemech_rule_ready (void) {
-    return HouseMechReady && housealmanac_tonight_ready();
+// Same as above for a string that is not expected to recur, e.g. a
+// sensor value.
+//
+static Tcl_Obj *housemech_rule_value (const char *value) {
+
+    Tcl_Obj *object = Tcl_NewStringObj (value, -1);
+    Tcl_IncrRefCount (object);
+    return object;
 }
 
-int housemech_rule_trigger_event
-        (const char *category, const char *name, const char *action) {
+// Build the name of a trigger proc, without any length limit.
+// The result is only valid until the next call.
+//
+static const char *housemech_rule_name (const char *kind, const char *a,
+                                        const char *b, const char *c) {
 
-    char buffer[256];
+    static __thread char *Name = 0;
+    static __thread int   NameSize = 0;
 
-    // Record the latest action for this specific event.
-    if (action) {
-        snprintf (buffer, sizeof(buffer),
-                  "House::event state {%s} {%s} {%s}", category, name, action);
-        Tcl_Eval (HouseMechInterpreter, buffer);
-    } else {
-        action = "";
+    int length = strlen(kind) + strlen(a) + 2;
+    if (b) length += strlen(b) + 1;
+    if (c) length += strlen(c) + 1;
+
+    if (length > NameSize) {
+        NameSize = length + 64;
+        Name = realloc (Name, NameSize);
     }
+    if (c)
+        snprintf (Name, NameSize, "%s.%s.%s.%s", kind, a, b, c);
+    else if (b)
+        snprintf (Name, NameSize, "%s.%s.%s", kind, a, b);
+    else
+        snprintf (Name, NameSize, "%s.%s", kind, a);
+    return Name;
+}
+
+// Execute the trigger proc, if it exists, with the specified arguments.
+// The first item of objv is reserved for the proc's command object.
+//
+static int housemech_rule_apply (const char *proc, int objc, Tcl_Obj *objv[]) {
+
+    Tcl_HashEntry *entry = Tcl_FindHashEntry (&HouseMechTriggers, proc);
+    if (!entry) return 0;
+
+    HouseMechTrigger *trigger = (HouseMechTrigger *)Tcl_GetHashValue (entry);
+    if (trigger->disabled) return 0;
+
+    objv[0] = trigger->command;
+
+    if (echttp_isdebug()) {
+        printf ("Applying rules %s\n", proc);
+        fflush (stdout);
+    }
+    long long start = housemech_profile_start ();
+    housemech_rule_limit_start ();
+    int status =
+        Tcl_EvalObjv (HouseMechInterpreter, objc, objv, TCL_EVAL_GLOBAL);
+    int overrun = housemech_rule_limit_end (proc);
+    housemech_profile_record (trigger->profile, start, status != TCL_OK);
+
+    if (overrun) {
+        if (++(trigger->overruns) >= HouseMechStrikes) {
+            char text[64];
+            trigger->disabled = 1;
+            snprintf (text, sizeof(text),
+                      "AFTER %d OVERRUNS", trigger->overruns);
+            housemech_rule_log ("SCRIPT", proc, "DISABLED", text);
+        }
+    }
+    if (status == TCL_OK) return 1;
+
+    DEBUG ("Rule %s failed: %s\n",
+           proc, Tcl_GetStringResult (HouseMechInterpreter));
+    return 0;
+}
+
+static int housemech_rule_apply_event
+        (const char *category, const char *name, const char *action) {
+
+    const char *proc;
+    Tcl_Obj *objv[3];
+    int result = 1;
+
+    Tcl_Obj *categoryobj = housemech_rule_intern (category);
+    Tcl_Obj *nameobj = housemech_rule_intern (name);
+    Tcl_Obj *actionobj = housemech_rule_intern (action);
 
     // Try to process the rules for this event in the following order
     // until one is successful:
@@ -289,93 +1191,415 @@ int housemech_rule_trigger_event
     // <category>.<name> <action> (where action is a parameter)
     // <category> <name> <action> (where name and action are parameters)
     //
-    snprintf (buffer, sizeof(buffer),
-              "{EVENT.%s.%s.%s}", category, name, action);
-    DEBUG ("Applying rules %s\n", buffer);
-    fflush (stdout);
-    if (Tcl_Eval (HouseMechInterpreter, buffer) == TCL_OK) goto success;
+    proc = housemech_rule_name ("EVENT", category, name, action);
+    if (housemech_rule_apply (proc, 1, objv)) goto success;
 
-    DEBUG ("Rule %s failed: %s\n",
-           buffer, Tcl_GetStringResult (HouseMechInterpreter));
-
-    snprintf (buffer, sizeof(buffer),
-              "{EVENT.%s.%s} {%s}", category, name, action);
-    DEBUG ("Applying rules %s\n", buffer);
-    fflush (stdout);
-    if (Tcl_Eval (HouseMechInterpreter, buffer) == TCL_OK) goto success;
-
-    DEBUG ("Rule for %s failed: %s\n",
-           buffer, Tcl_GetStringResult (HouseMechInterpreter));
-
-    snprintf (buffer, sizeof(buffer),
-              "{EVENT.%s} {%s} {%s}", category, name, action);
-    DEBUG ("Applying rules %s\n", buffer);
-    fflush (stdout);
-    if (Tcl_Eval (HouseMechInterpreter, buffer) == TCL_OK) goto success;
-
-    DEBUG ("Rule for %s failed: %s\n",
-           buffer, Tcl_GetStringResult (HouseMechInterpreter));
-    housecapture_record (EventCapture, name, "IGNORE", "%s", buffer);
-    return 0;
+    proc = housemech_rule_name ("EVENT", category, name, 0);
+    objv[1] = actionobj;
+    if (housemech_rule_apply (proc, 2, objv)) goto success;
+
+    proc = housemech_rule_name ("EVENT", category, 0, 0);
+    objv[1] = nameobj;
+    objv[2] = actionobj;
+    if (housemech_rule_apply (proc, 3, objv)) goto success;
+
+    CAPTURE (EventCapture, name, "IGNORE",
+             "{%s} {%s} {%s}", category, name, action);
+    result = 0;
+    goto cleanup;
 
 success:
-    housecapture_record (EventCapture, name, "TRIGGER", "%s", buffer);
-    return 1;
+    CAPTURE (EventCapture, name, "TRIGGER",
+             "%s {%s} {%s} {%s}", proc, category, name, action);
+cleanup:
+    Tcl_DecrRefCount (categoryobj);
+    Tcl_DecrRefCount (nameobj);
+    Tcl_DecrRefCount (actionobj);
+    return result;
 }
 
-int housemech_rule_trigger_sensor
+static int housemech_rule_apply_sensor
        (const char *location, const char *name, const char *value) {
 
-    char buffer[256];
+    const char *proc;
+    Tcl_Obj *objv[3];
+    int result = 1;
+
+    Tcl_Obj *locationobj = housemech_rule_intern (location);
+    Tcl_Obj *nameobj = housemech_rule_intern (name);
+    Tcl_Obj *valueobj = housemech_rule_value (value);
 
     // Try to process the rules for this sensor data in the following order
     // until one is successful:
     // <location>.<name> <value> (where value is a parameter)
     // <location> <name> <value> (where name and value are parameters)
     //
-    snprintf (buffer, sizeof(buffer),
-              "{SENSOR.%s.%s} {%s}", location, name, value);
-    DEBUG ("Applying rules %s\n", buffer);
-    fflush (stdout);
-    if (Tcl_Eval (HouseMechInterpreter, buffer) == TCL_OK) goto success;
-
-    DEBUG ("Rule for %s failed: %s\n",
-           buffer, Tcl_GetStringResult (HouseMechInterpreter));
-
-    snprintf (buffer, sizeof(buffer),
-              "{SENSOR.%s} {%s} {%s}", name, location, value);
-    DEBUG ("Applying rules %s\n", buffer);
-    fflush (stdout);
-    if (Tcl_Eval (HouseMechInterpreter, buffer) == TCL_OK) goto success;
-
-    DEBUG ("Rule for %s failed: %s\n",
-           buffer, Tcl_GetStringResult (HouseMechInterpreter));
-    housecapture_record (SensorCapture, name, "IGNORE", "%s", buffer);
-    return 0;
+    proc = housemech_rule_name ("SENSOR", location, name, 0);
+    objv[1] = valueobj;
+    if (housemech_rule_apply (proc, 2, objv)) goto success;
+
+    proc = housemech_rule_name ("SENSOR", name, 0, 0);
+    objv[1] = locationobj;
+    objv[2] = valueobj;
+    if (housemech_rule_apply (proc, 3, objv)) goto success;
+
+    CAPTURE (SensorCapture, name, "IGNORE",
+             "{%s} {%s} {%s}", location, name, value);
+    result = 0;
+    goto cleanup;
 
 success:
-    housecapture_record (SensorCapture, name, "TRIGGER", "%s", buffer);
-    return 1;
+    CAPTURE (SensorCapture, name, "TRIGGER",
+             "%s {%s} {%s} {%s}", proc, location, name, value);
+cleanup:
+    Tcl_DecrRefCount (locationobj);
+    Tcl_DecrRefCount (nameobj);
+    Tcl_DecrRefCount (valueobj);
+    return result;
+}
+
+// When worker threads are used, the event and sensor triggers are executed
+// by the workers, sharded by event or sensor: the triggers for the same
+// event or sensor are executed in order. The control and schedule triggers,
+// and the timer scripts, are always executed by the main thread.
+//
+int housemech_rule_trigger_event
+        (const char *category, const char *name, const char *action) {
+
+    const char *latest = action;
+    if (!action) action = "";
+
+    if (housemech_worker_count() > 0) {
+        const char *argv[3] = {category, name, action};
+        if (!housemech_worker_submit
+                 (housemech_rule_name ("EVENT", category, name, 0),
+                  'E', 3, argv)) return -1;
+
+        // The worker cannot query the event state before the main thread
+        // returns to its loop: the state is recorded in time.
+        if (latest) housemech_state_set (category, name, latest);
+        return 1;
+    }
+
+    // Record the latest action for this specific event.
+    if (latest) housemech_state_set (category, name, latest);
+    return housemech_rule_apply_event (category, name, action);
+}
+
+int housemech_rule_trigger_sensor
+       (const char *location, const char *name, const char *value) {
+
+    if (housemech_worker_count() > 0) {
+        const char *argv[3] = {location, name, value};
+        if (!housemech_worker_submit
+                 (housemech_rule_name ("SENSOR", location, name, 0),
+                  'S', 3, argv)) return -1;
+        return 1;
+    }
+    return housemech_rule_apply_sensor (location, name, value);
+}
+
+static void housemech_rule_worker_start (void) {
+
+    Tcl_InitHashTable (&HouseMechTriggers, TCL_STRING_KEYS);
+    Tcl_InitHashTable (&HouseMechStrings, TCL_STRING_KEYS);
+
+    HouseMechInterpreter = housemech_rule_interpreter ();
+    if (!HouseMechInterpreter) exit(1);
+}
+
+static void housemech_rule_worker_process (char kind,
+                                           int argc, const char **argv) {
+    switch (kind) {
+        case 'L':
+            housemech_rule_load (argv[0]);
+            break;
+        case 'E':
+            housemech_rule_apply_event (argv[0], argv[1], argv[2]);
+            break;
+        case 'S':
+            housemech_rule_apply_sensor (argv[0], argv[1], argv[2]);
+            break;
+    }
+}
+
+// Execute a command forwarded by a worker thread.
+//
+static char *housemech_rule_worker_forwarded (const char *command,
+                                              int *status) {
+
+    Tcl_Obj *script = Tcl_NewStringObj (command, -1);
+    Tcl_IncrRefCount (script);
+    *status = Tcl_EvalObjEx (HouseMechInterpreter, script, TCL_EVAL_GLOBAL);
+    Tcl_DecrRefCount (script);
+    return strdup (Tcl_GetStringResult (HouseMechInterpreter));
 }
 
 int housemech_rule_trigger_control (const char *name, const char *state) {
 
-    char buffer[256];
-    snprintf (buffer, sizeof(buffer), "{POINT.%s} {%s}", name, state);
-    DEBUG ("Applying rules %s\n", buffer);
-    fflush (stdout);
-    if (Tcl_Eval (HouseMechInterpreter, buffer) == TCL_OK) goto success;
+    Tcl_Obj *objv[2];
 
-    DEBUG ("Rule %s failed: %s\n",
-           buffer, Tcl_GetStringResult (HouseMechInterpreter));
-    housecapture_record (ControlCapture, name, "IGNORE", "%s", buffer);
-    return 0;
+    const char *proc = housemech_rule_name ("POINT", name, 0, 0);
+    if (!Tcl_FindHashEntry (&HouseMechTriggers, proc)) {
+        CAPTURE (ControlCapture, name, "IGNORE",
+                 "{%s} {%s}", name, state);
+        return 0;
+    }
+    objv[1] = housemech_rule_intern (state);
+    int result = housemech_rule_apply (proc, 2, objv);
+    Tcl_DecrRefCount (objv[1]);
 
-success:
-    housecapture_record (ControlCapture, name, "TRIGGER", "%s", buffer);
+    CAPTURE (ControlCapture, name, result?"TRIGGER":"IGNORE",
+             "%s {%s}", proc, state);
+    return result;
+}
+
+// The schedule triggers (TIME.*) are executed at a specific time of day,
+// either a clock time (TIME.<hh>:<mm>) or relative to sunset or sunrise
+// (TIME.sunset, TIME.sunrise-30m, TIME.sunset+1h, etc). Their deadlines
+// are managed by the timer module, and the sunset and sunrise deadlines
+// are recomputed only when the almanac changes.
+//
+typedef struct {
+    const char *proc;
+    char kind;          // 's' (sunset), 'r' (sunrise) or 'c' (clock).
+    int offset;         // Seconds from sunset, sunrise or midnight.
+    time_t deadline;
+    time_t fired;
+    long long timer;
+} HouseMechSchedule;
+
+static HouseMechSchedule *HouseMechSchedules = 0;
+static int HouseMechSchedulesCount = 0;
+
+static time_t HouseMechSunset = 0;
+static time_t HouseMechSunrise = 0;
+
+static int housemech_rule_schedule_parse (HouseMechSchedule *schedule,
+                                          const char *spec) {
+
+    if (!strncmp (spec, "sunset", 6)) {
+        schedule->kind = 's';
+        spec += 6;
+    } else if (!strncmp (spec, "sunrise", 7)) {
+        schedule->kind = 'r';
+        spec += 7;
+    } else {
+        int hour, minute, length = 0;
+        if (sscanf (spec, "%d:%d%n", &hour, &minute, &length) < 2) return 0;
+        if (spec[length]) return 0;
+        if ((hour < 0) || (hour > 23) || (minute < 0) || (minute > 59))
+            return 0;
+        schedule->kind = 'c';
+        schedule->offset = (hour * 60 + minute) * 60;
+        return 1;
+    }
+
+    // Optional offset, in minutes unless a unit (s, m or h) is specified.
+    schedule->offset = 0;
+    if (*spec == 0) return 1;
+    if ((*spec != '+') && (*spec != '-')) return 0;
+    if (!isdigit(spec[1])) return 0;
+
+    char *unit;
+    int offset = (int) strtol (spec, &unit, 10);
+    switch (*unit) {
+        case 's': break;
+        case 0:
+        case 'm': offset *= 60; break;
+        case 'h': offset *= 3600; break;
+        default: return 0;
+    }
+    if (*unit && unit[1]) return 0;
+    schedule->offset = offset;
     return 1;
 }
 
+// Return the next clock time after now, for the specified time of day.
+//
+static time_t housemech_rule_schedule_clock (int offset, time_t now) {
+
+    struct tm local = *localtime (&now);
+    int day;
+
+    for (day = 0; day <= 1; ++day) {
+        local.tm_mday += day;
+        local.tm_hour = offset / 3600;
+        local.tm_min = (offset / 60) % 60;
+        local.tm_sec = 0;
+        local.tm_isdst = -1;
+        time_t deadline = mktime (&local);
+        if (deadline > now) return deadline;
+    }
+    return 0;
+}
+
+static void housemech_rule_schedule_expire (void *context);
+
+static void housemech_rule_schedule_arm (HouseMechSchedule *schedule,
+                                         time_t now) {
+
+    time_t base;
+    time_t candidates[3];
+    int i, count = 0;
+
+    if (schedule->timer) {
+        housemech_timer_cancel (schedule->timer);
+        schedule->timer = 0;
+    }
+
+    switch (schedule->kind) {
+        case 'c':
+            candidates[count++] =
+                housemech_rule_schedule_clock (schedule->offset, now);
+            break;
+        case 's':
+        case 'r':
+            base = (schedule->kind == 's') ? HouseMechSunset : HouseMechSunrise;
+            if (base <= 0) return; // Almanac not available yet.
+
+            // The almanac only tells about the current or upcoming night:
+            // estimate the previous and next days from it. An estimate is
+            // corrected when the almanac moves to the next night.
+            //
+            candidates[count++] = base + schedule->offset - 24*60*60;
+            candidates[count++] = base + schedule->offset;
+            candidates[count++] = base + schedule->offset + 24*60*60;
+            break;
+        default:
+            return;
+    }
+
+    for (i = 0; i < count; ++i) {
+        time_t deadline = candidates[i];
+        if (deadline <= now) continue;
+        // Do not fire twice for the same day, even if the time moved a bit.
+        if (schedule->fired && (deadline - schedule->fired < 2*60*60))
+            continue;
+        schedule->deadline = deadline;
+        schedule->timer =
+            housemech_timer_start ((long long)(deadline - now) * 1000,
+                                   housemech_rule_schedule_expire, schedule);
+        DEBUG ("Schedule %s at %s", schedule->proc, ctime (&deadline));
+        return;
+    }
+}
+
+static void housemech_rule_schedule_expire (void *context) {
+
+    HouseMechSchedule *schedule = (HouseMechSchedule *)context;
+    Tcl_Obj *objv[1];
+
+    schedule->timer = 0;
+    schedule->fired = schedule->deadline;
+
+    if (housemech_rule_apply (schedule->proc, 1, objv))
+        CAPTURE (TimeCapture, schedule->proc, "TRIGGER",
+                 "%lld", (long long)(schedule->deadline));
+
+    housemech_rule_schedule_arm (schedule, time(0));
+}
+
+// (Re)build the list of schedule triggers from the indexed TIME.* procs.
+//
+static void housemech_rule_schedule (void) {
+
+    int i;
+    Tcl_HashEntry *entry;
+    Tcl_HashSearch search;
+
+    for (i = 0; i < HouseMechSchedulesCount; ++i) {
+        if (HouseMechSchedules[i].timer)
+            housemech_timer_cancel (HouseMechSchedules[i].timer);
+    }
+    free (HouseMechSchedules);
+    HouseMechSchedules = 0;
+    HouseMechSchedulesCount = 0;
+
+    for (entry = Tcl_FirstHashEntry (&HouseMechTriggers, &search);
+         entry; entry = Tcl_NextHashEntry (&search)) {
+        const char *proc = Tcl_GetHashKey (&HouseMechTriggers, entry);
+        if (!strncmp (proc, "TIME.", 5)) HouseMechSchedulesCount += 1;
+    }
+    if (HouseMechSchedulesCount <= 0) return;
+
+    HouseMechSchedules =
+        calloc (HouseMechSchedulesCount, sizeof(HouseMechSchedule));
+    HouseMechSchedulesCount = 0;
+
+    time_t now = time(0);
+
+    for (entry = Tcl_FirstHashEntry (&HouseMechTriggers, &search);
+         entry; entry = Tcl_NextHashEntry (&search)) {
+        const char *proc = Tcl_GetHashKey (&HouseMechTriggers, entry);
+        if (strncmp (proc, "TIME.", 5)) continue;
+
+        HouseMechSchedule *schedule =
+            HouseMechSchedules + HouseMechSchedulesCount;
+        if (!housemech_rule_schedule_parse (schedule, proc + 5)) {
+            houselog_trace (HOUSE_FAILURE, "SCRIPT",
+                            "invalid schedule trigger %s", proc);
+            continue;
+        }
+        schedule->proc = proc;
+        housemech_rule_schedule_arm (schedule, now);
+        HouseMechSchedulesCount += 1;
+    }
+}
+
+// Recompute the sunset and sunrise schedules when the almanac changed.
+//
+static void housemech_rule_schedule_almanac (time_t now) {
+
+    if (!housealmanac_tonight_ready()) return;
+
+    time_t sunset = housealmanac_tonight_sunset();
+    time_t sunrise = housealmanac_tonight_sunrise();
+    if ((sunset == HouseMechSunset) && (sunrise == HouseMechSunrise)) return;
+
+    HouseMechSunset = sunset;
+    HouseMechSunrise = sunrise;
+
+    int i;
+    for (i = 0; i < HouseMechSchedulesCount; ++i) {
+        if (HouseMechSchedules[i].kind != 'c')
+            housemech_rule_schedule_arm (HouseMechSchedules + i, now);
+    }
+}
+
+int housemech_rule_status (char *buffer, int size) {
+
+    int cursor;
+    long long average = 0;
+
+    if (HouseMechTimerFired > 0)
+        average = HouseMechTimerLateTotal / HouseMechTimerFired;
+
+    cursor = snprintf (buffer, size,
+                       ",\"rules\":{\"schedules\":%d,\"overruns\":%lld"
+                       ",\"timers\":{\"active\":%d"
+                       ",\"fired\":%lld,\"failed\":%lld"
+                       ",\"late\":{\"max\":%lld,\"average\":%lld}}}",
+                       HouseMechSchedulesCount,
+                       (long long)atomic_load (&HouseMechOverruns),
+                       HouseMechTimers.numEntries,
+                       HouseMechTimerFired, HouseMechTimerFailed,
+                       HouseMechTimerLateMax, average);
+    if (cursor >= size) goto overflow;
+
+    return cursor;
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "STATUS",
+                    "BUFFER TOO SMALL (NEED %d bytes)", cursor);
+    buffer[0] = 0;
+    return 0;
+}
+
+int housemech_rule_ready (void) {
+    return HouseMechReady && housealmanac_tonight_ready();
+}
+
 void housemech_rule_background (time_t now) {
 
     static time_t NextTclCycle = 0;
@@ -383,6 +1607,6 @@ void housemech_rule_background (time_t now) {
     if (now < NextTclCycle) return;
     NextTclCycle = now + HOUSE_TCL_CYCLE;
 
-    // TBD
+    housemech_rule_schedule_almanac (now);
 }
 
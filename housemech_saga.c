@@ -0,0 +1,106 @@
+/* HouseMech - A simple home web service to automate actions.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemech_saga.c - Decode the records returned by HouseSaga.
+ *
+ * SYNOPSYS:
+ *
+ * Both events and sensor data are returned by HouseSaga as arrays of
+ * records, each record being itself an array with fixed positions:
+ *
+ *    [timestamp, category, name, action, ..., id]     (events)
+ *    [timestamp, location, name, value, ..., id]      (sensor data)
+ *
+ * This module decodes one record in a single walk through its items,
+ * instead of searching for each item independently.
+ *
+ * int housemech_saga_decode (const ParserToken *record,
+ *                            HouseMechSagaRecord *decoded);
+ *
+ *    Decode one record. Return 1 on success, 0 if the record is not
+ *    a valid HouseSaga record (the content of decoded is then undefined).
+ *    The strings in the decoded record point to the parsed JSON data and
+ *    remain valid only as long as this JSON data is not modified.
+ */
+
+#include <echttp_json.h>
+
+#include "housemech_saga.h"
+
+#define HOUSE_SAGA_TIMESTAMP 0
+#define HOUSE_SAGA_CATEGORY  1
+#define HOUSE_SAGA_NAME      2
+#define HOUSE_SAGA_ACTION    3
+#define HOUSE_SAGA_ID        7
+
+// Return the number of tokens used by this item, including its own
+// inner items if any.
+//
+static int housemech_saga_span (const ParserToken *item) {
+
+    if ((item->type != PARSER_ARRAY) && (item->type != PARSER_OBJECT))
+        return 1;
+
+    int i;
+    int span = 1;
+    for (i = 0; i < item->length; ++i) {
+        span += housemech_saga_span (item + span);
+    }
+    return span;
+}
+
+static const char *housemech_saga_string (const ParserToken *item) {
+    if (item->type != PARSER_STRING) return "";
+    return item->value.string;
+}
+
+int housemech_saga_decode (const ParserToken *record,
+                           HouseMechSagaRecord *decoded) {
+
+    if (record->type != PARSER_ARRAY) return 0;
+    if (record->length <= HOUSE_SAGA_ID) return 0;
+
+    int i;
+    const ParserToken *item = record + 1;
+
+    for (i = 0; i <= HOUSE_SAGA_ID; ++i) {
+        switch (i) {
+            case HOUSE_SAGA_TIMESTAMP:
+                if (item->type != PARSER_INTEGER) return 0;
+                decoded->timestamp = item->value.integer;
+                break;
+            case HOUSE_SAGA_CATEGORY:
+                decoded->category = housemech_saga_string (item);
+                break;
+            case HOUSE_SAGA_NAME:
+                decoded->name = housemech_saga_string (item);
+                break;
+            case HOUSE_SAGA_ACTION:
+                decoded->action = housemech_saga_string (item);
+                break;
+            case HOUSE_SAGA_ID:
+                if (item->type != PARSER_INTEGER) return 0;
+                decoded->id = item->value.integer;
+                break;
+        }
+        item += housemech_saga_span (item);
+    }
+    return 1;
+}
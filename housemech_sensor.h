@@ -21,6 +21,4 @@
  * housemech_sensor.h - Manage the interface with HouseSaga.
  */
 void housemech_sensor_initialize (int argc, const char **argv);
-int  housemech_sensor_status (char *buffer, int size);
-void housemech_sensor_background (time_t now);
 
@@ -0,0 +1,203 @@
+/* HouseMech - A simple home web service to automate actions.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemech_state.c - Keep the latest state of each event.
+ *
+ * SYNOPSYS:
+ *
+ * This module records the latest action of each event, identified by
+ * its category and name, with the time of that action and the number of
+ * actions recorded so far. This is used by the rules to check the state
+ * of events, and is also made available through the HTTP interface.
+ *
+ * void housemech_state_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * void housemech_state_set (const char *category,
+ *                           const char *name, const char *action);
+ *
+ *    Record the latest action for the specified event.
+ *
+ * const char *housemech_state_get (const char *category, const char *name);
+ *
+ *    Return the latest action for the specified event, or an empty
+ *    string if no action was recorded.
+ *
+ * time_t housemech_state_time (const char *category, const char *name);
+ *
+ * int housemech_state_count (const char *category, const char *name);
+ *
+ *    Return the time of the latest action, or the number of actions
+ *    recorded, for the specified event. Return 0 if no action was recorded.
+ *
+ * int housemech_state_status (char *buffer, int size,
+ *                             const char *category, const char *name);
+ *
+ *    Return the recorded state of events in JSON format. The category
+ *    and name are optional filters (ignored if null).
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <tcl.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+
+#include "housemech_state.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+typedef struct {
+    const char *category;
+    const char *name;
+    char *action;
+    time_t timestamp;
+    int count;
+} HouseMechEventState;
+
+// The events are indexed by "<category>.<name>", which is the same
+// naming convention as for the event trigger procs.
+//
+static Tcl_HashTable HouseMechStates;
+
+static const char *housemech_state_key (const char *category,
+                                        const char *name) {
+
+    static char *Key = 0;
+    static int   KeySize = 0;
+
+    int length = strlen(category) + strlen(name) + 2;
+    if (length > KeySize) {
+        KeySize = length + 64;
+        Key = realloc (Key, KeySize);
+    }
+    snprintf (Key, KeySize, "%s.%s", category, name);
+    return Key;
+}
+
+static HouseMechEventState *housemech_state_search (const char *category,
+                                                    const char *name) {
+
+    Tcl_HashEntry *entry =
+        Tcl_FindHashEntry (&HouseMechStates,
+                           housemech_state_key (category, name));
+    if (!entry) return 0;
+    return (HouseMechEventState *)Tcl_GetHashValue (entry);
+}
+
+void housemech_state_initialize (int argc, const char **argv) {
+
+    Tcl_InitHashTable (&HouseMechStates, TCL_STRING_KEYS);
+}
+
+void housemech_state_set (const char *category,
+                          const char *name, const char *action) {
+
+    int isnew;
+    HouseMechEventState *state;
+    Tcl_HashEntry *entry =
+        Tcl_CreateHashEntry (&HouseMechStates,
+                             housemech_state_key (category, name), &isnew);
+
+    if (isnew) {
+        state = calloc (1, sizeof(HouseMechEventState));
+        state->category = strdup (category);
+        state->name = strdup (name);
+        Tcl_SetHashValue (entry, state);
+        DEBUG ("New event state %s.%s\n", category, name);
+    } else {
+        state = (HouseMechEventState *)Tcl_GetHashValue (entry);
+    }
+
+    // Actions tend to repeat: avoid reallocating the same value.
+    if ((!state->action) || strcmp (state->action, action)) {
+        if (state->action) free (state->action);
+        state->action = strdup (action);
+    }
+    state->timestamp = time(0);
+    state->count += 1;
+}
+
+const char *housemech_state_get (const char *category, const char *name) {
+
+    HouseMechEventState *state = housemech_state_search (category, name);
+    if (!state) return "";
+    return state->action;
+}
+
+time_t housemech_state_time (const char *category, const char *name) {
+
+    HouseMechEventState *state = housemech_state_search (category, name);
+    if (!state) return 0;
+    return state->timestamp;
+}
+
+int housemech_state_count (const char *category, const char *name) {
+
+    HouseMechEventState *state = housemech_state_search (category, name);
+    if (!state) return 0;
+    return state->count;
+}
+
+int housemech_state_status (char *buffer, int size,
+                            const char *category, const char *name) {
+
+    int cursor;
+    const char *prefix = "";
+    Tcl_HashEntry *entry;
+    Tcl_HashSearch search;
+
+    cursor = snprintf (buffer, size, ",\"states\":[");
+    if (cursor >= size) goto overflow;
+
+    for (entry = Tcl_FirstHashEntry (&HouseMechStates, &search);
+         entry; entry = Tcl_NextHashEntry (&search)) {
+
+        HouseMechEventState *state =
+            (HouseMechEventState *)Tcl_GetHashValue (entry);
+
+        if (category && strcmp (category, state->category)) continue;
+        if (name && strcmp (name, state->name)) continue;
+
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s[\"%s\",\"%s\",\"%s\",%lld,%d]",
+                            prefix, state->category, state->name,
+                            state->action,
+                            (long long)(state->timestamp), state->count);
+        if (cursor >= size) goto overflow;
+        prefix = ",";
+    }
+
+    cursor += snprintf (buffer+cursor, size-cursor, "]");
+    if (cursor >= size) goto overflow;
+
+    return cursor;
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "STATE",
+                    "BUFFER TOO SMALL (NEED %d bytes)", cursor);
+    buffer[0] = 0;
+    return 0;
+}
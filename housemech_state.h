@@ -0,0 +1,34 @@
+/* HouseMech - a web server for home automation
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemech_state.h - Keep the latest state of each event.
+ */
+void housemech_state_initialize (int argc, const char **argv);
+
+void housemech_state_set (const char *category,
+                          const char *name, const char *action);
+
+const char *housemech_state_get (const char *category, const char *name);
+time_t      housemech_state_time (const char *category, const char *name);
+int         housemech_state_count (const char *category, const char *name);
+
+int housemech_state_status (char *buffer, int size,
+                            const char *category, const char *name);
+
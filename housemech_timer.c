@@ -0,0 +1,276 @@
+/* HouseMech - A simple home web service to automate actions.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemech_timer.c - A millisecond timer facility.
+ *
+ * SYNOPSYS:
+ *
+ * This module lets each module schedule its own deadlines, with a
+ * millisecond resolution, instead of depending on the one second cycle
+ * of the main loop. The pending deadlines are kept in a min-heap, and
+ * a timer file descriptor wakes up the main loop when the earliest
+ * deadline is reached.
+ *
+ * All times are in milliseconds, based on a monotonic clock.
+ *
+ * void housemech_timer_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * long long housemech_timer_now (void);
+ *
+ *    Return the current (monotonic) time in milliseconds.
+ *
+ * long long housemech_timer_start (long long delay,
+ *                                  housemech_timer_handler *handler,
+ *                                  void *context);
+ *
+ *    Call the handler, with the specified context, once the delay
+ *    has elapsed. Return an ID that can be used to cancel the timer.
+ *    A timer is automatically removed after its handler was called:
+ *    a periodic timer must restart itself.
+ *
+ * int housemech_timer_cancel (long long id);
+ *
+ *    Remove a pending timer. Return 1 if the timer was still pending,
+ *    0 otherwise.
+ *
+ * int housemech_timer_active (void);
+ *
+ *    Return the number of pending timers.
+ *
+ * void housemech_timer_background (void);
+ *
+ *    Call the handlers of all expired timers. This is normally done when
+ *    the timer file descriptor wakes up the main loop: calling this on
+ *    every pass of the main loop is only a fallback.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+
+#include "housemech_timer.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+typedef struct {
+    long long deadline;
+    housemech_timer_handler *handler;
+    void *context;
+    int position;   // Index in the heap, -1 if the slot is free.
+    int generation; // Avoid canceling a newer timer using an old ID.
+    int next;       // Next free slot.
+} HouseTimer;
+
+static HouseTimer *Timers = 0;
+static int         TimersAllocated = 0;
+static int         TimersFree = -1;
+
+static int *Heap = 0;
+static int  HeapCount = 0;
+
+static int HouseTimerFd = -1;
+
+
+long long housemech_timer_now (void) {
+
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void housemech_timer_arm (void) {
+
+    if (HouseTimerFd < 0) return;
+
+    struct itimerspec value;
+    memset (&value, 0, sizeof(value));
+
+    if (HeapCount > 0) {
+        // An absolute time in the past expires immediately, but zero
+        // would disarm the timer.
+        long long deadline = Timers[Heap[0]].deadline;
+        if (deadline <= 0) deadline = 1;
+        value.it_value.tv_sec = deadline / 1000;
+        value.it_value.tv_nsec = (deadline % 1000) * 1000000;
+    }
+    timerfd_settime (HouseTimerFd, TFD_TIMER_ABSTIME, &value, 0);
+}
+
+static void housemech_timer_swap (int a, int b) {
+
+    int slot = Heap[a];
+    Heap[a] = Heap[b];
+    Heap[b] = slot;
+    Timers[Heap[a]].position = a;
+    Timers[Heap[b]].position = b;
+}
+
+static void housemech_timer_up (int position) {
+
+    while (position > 0) {
+        int parent = (position - 1) / 2;
+        if (Timers[Heap[parent]].deadline <= Timers[Heap[position]].deadline)
+            break;
+        housemech_timer_swap (parent, position);
+        position = parent;
+    }
+}
+
+static void housemech_timer_down (int position) {
+
+    for (;;) {
+        int smallest = position;
+        int left = 2 * position + 1;
+        int right = left + 1;
+        if ((left < HeapCount) &&
+            (Timers[Heap[left]].deadline < Timers[Heap[smallest]].deadline))
+            smallest = left;
+        if ((right < HeapCount) &&
+            (Timers[Heap[right]].deadline < Timers[Heap[smallest]].deadline))
+            smallest = right;
+        if (smallest == position) break;
+        housemech_timer_swap (smallest, position);
+        position = smallest;
+    }
+}
+
+static void housemech_timer_remove (int slot) {
+
+    int position = Timers[slot].position;
+
+    HeapCount -= 1;
+    if (position < HeapCount) {
+        housemech_timer_swap (position, HeapCount);
+        housemech_timer_down (position);
+        housemech_timer_up (position);
+    }
+    Timers[slot].position = -1;
+    Timers[slot].handler = 0;
+    Timers[slot].generation += 1;
+    Timers[slot].next = TimersFree;
+    TimersFree = slot;
+}
+
+long long housemech_timer_start (long long delay,
+                                 housemech_timer_handler *handler,
+                                 void *context) {
+
+    if (TimersFree < 0) {
+        int i;
+        int old = TimersAllocated;
+        TimersAllocated += 32;
+        Timers = realloc (Timers, TimersAllocated * sizeof(HouseTimer));
+        Heap = realloc (Heap, TimersAllocated * sizeof(int));
+        if ((!Timers) || (!Heap)) {
+            houselog_trace (HOUSE_FAILURE, "TIMER", "no more memory");
+            exit (1);
+        }
+        for (i = TimersAllocated - 1; i >= old; --i) {
+            Timers[i].position = -1;
+            Timers[i].generation = 1;
+            Timers[i].next = TimersFree;
+            TimersFree = i;
+        }
+    }
+    int slot = TimersFree;
+    HouseTimer *timer = Timers + slot;
+    TimersFree = timer->next;
+
+    if (delay < 0) delay = 0;
+    timer->deadline = housemech_timer_now() + delay;
+    timer->handler = handler;
+    timer->context = context;
+    timer->position = HeapCount;
+    Heap[HeapCount++] = slot;
+    housemech_timer_up (timer->position);
+
+    if (Heap[0] == slot) housemech_timer_arm ();
+
+    return ((long long)timer->generation << 32) + slot;
+}
+
+int housemech_timer_cancel (long long id) {
+
+    int slot = (int)(id & 0xffffffff);
+    int generation = (int)(id >> 32);
+
+    if ((slot < 0) || (slot >= TimersAllocated)) return 0;
+    if (Timers[slot].position < 0) return 0;
+    if (Timers[slot].generation != generation) return 0;
+
+    int first = (Timers[slot].position == 0);
+    housemech_timer_remove (slot);
+    if (first) housemech_timer_arm ();
+    return 1;
+}
+
+int housemech_timer_active (void) {
+    return HeapCount;
+}
+
+void housemech_timer_background (void) {
+
+    long long now = housemech_timer_now ();
+    int expired = 0;
+
+    while (HeapCount > 0) {
+        int slot = Heap[0];
+        if (Timers[slot].deadline > now) break;
+
+        housemech_timer_handler *handler = Timers[slot].handler;
+        void *context = Timers[slot].context;
+        housemech_timer_remove (slot);
+        expired = 1;
+
+        // The handler may start or cancel timers.
+        handler (context);
+    }
+    if (expired) housemech_timer_arm ();
+}
+
+static void housemech_timer_wakeup (int fd, int mode) {
+
+    uint64_t count;
+    if (read (fd, &count, sizeof(count)) < 0) {
+        // Nothing to do: the timer was probably re-armed since.
+    }
+    housemech_timer_background ();
+}
+
+void housemech_timer_initialize (int argc, const char **argv) {
+
+    HouseTimerFd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (HouseTimerFd < 0) {
+        houselog_trace (HOUSE_FAILURE, "TIMER", "cannot create timer");
+        return; // Fall back to the main loop's background pass.
+    }
+    echttp_listen (HouseTimerFd, 1, housemech_timer_wakeup, 0);
+    housemech_timer_arm ();
+}
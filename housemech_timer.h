@@ -0,0 +1,36 @@
+/* HouseMech - a web server for home automation
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemech_timer.h - A millisecond timer facility.
+ */
+typedef void housemech_timer_handler (void *context);
+
+void housemech_timer_initialize (int argc, const char **argv);
+
+long long housemech_timer_now (void);
+
+long long housemech_timer_start (long long delay,
+                                 housemech_timer_handler *handler,
+                                 void *context);
+int       housemech_timer_cancel (long long id);
+
+int  housemech_timer_active (void);
+void housemech_timer_background (void);
+
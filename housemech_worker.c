@@ -0,0 +1,494 @@
+/* HouseMech - A simple home web service to automate actions.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemech_worker.c - Run the triggers on a pool of worker threads.
+ *
+ * SYNOPSYS:
+ *
+ * This module is only active if the -rule-workers=N option is present.
+ * Each worker thread has its own (Tcl) environment, set up by the start
+ * callback. The work is sharded among the workers using a key, so that
+ * all work items with the same key are processed in order by the same
+ * worker.
+ *
+ * The main thread and the workers only communicate through lock-free
+ * single producer / single consumer rings, one in each direction for
+ * each worker, and eventfd wakeups. A worker never touches the main
+ * thread's data: it forwards commands to the main thread instead. The
+ * main thread never waits for a worker: when a worker's ring is full,
+ * the work items are kept in a backlog, owned by the main thread, until
+ * the worker wakes up the main thread to tell that it made room. If the
+ * backlog is full too, the work item is refused (and counted): the caller
+ * must keep it and submit it again later. A work item for all workers
+ * (e.g. loading a script) is never refused.
+ *
+ * int housemech_worker_initialize (int argc, const char **argv,
+ *                                  housemech_worker_start *start,
+ *                                  housemech_worker_process *process,
+ *                                  housemech_worker_forwarded *forwarded);
+ *
+ *    Initialize this module and start the worker threads. The start
+ *    and process callbacks are called in the worker threads, while the
+ *    forwarded callback is called in the main thread. Return the number
+ *    of workers (0 when the workers are disabled).
+ *
+ * int housemech_worker_count (void);
+ *
+ *    Return the number of workers (0 when the workers are disabled).
+ *
+ * int housemech_worker_self (void);
+ *
+ *    Return 0 when called from the main thread, or the worker's number
+ *    (starting at 1) when called from a worker thread.
+ *
+ * int housemech_worker_submit (const char *key,
+ *                              char kind, int argc, const char **argv);
+ *
+ *    Queue a work item for the worker selected by the key, or for all
+ *    workers if the key is null. The strings are copied. The process
+ *    callback is later called with the same kind and strings. Return 1
+ *    if the work item was queued, 0 if the selected worker is too far
+ *    behind: the work item was not queued and must be submitted again.
+ *
+ * char *housemech_worker_forward (const char *command, int wait, int *status);
+ *
+ *    Called from a worker thread: queue a command to be processed by the
+ *    forwarded callback in the main thread. If wait is true, the worker
+ *    is blocked until the command was processed, and the result (to be
+ *    freed by the caller) is returned. Otherwise this returns null.
+ *
+ * int housemech_worker_status (char *buffer, int size);
+ *
+ *    A function that populates the status of this module in JSON.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+
+#include "housemech_worker.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_WORKER_MAX   16
+#define HOUSE_WORKER_RING  1024 // Must be a power of 2.
+#define HOUSE_WORKER_ARGS  8
+
+typedef struct {
+    char kind;      // 0 for a forwarded command.
+    char wait;
+    char count;
+    char *data;     // The strings, one after the other (owned by the receiver).
+} HouseWorkerMessage;
+
+typedef struct {
+    HouseWorkerMessage items[HOUSE_WORKER_RING];
+    atomic_uint head; // Next item to consume.
+    atomic_uint tail; // Next item to produce.
+} HouseWorkerRing;
+
+typedef struct HouseWorkerBacklog {
+    HouseWorkerMessage message;
+    struct HouseWorkerBacklog *next;
+} HouseWorkerBacklog;
+
+typedef struct {
+    int number;
+    pthread_t thread;
+    int wakeup;
+    atomic_int sleeping;
+    HouseWorkerRing input;  // From the main thread to the worker.
+    HouseWorkerRing output; // From the worker to the main thread.
+    sem_t replied;
+    char *reply;
+    int status;
+    atomic_llong processed;
+    atomic_llong forwarded;
+    atomic_int backlogged;
+    HouseWorkerBacklog *backlog; // Main thread only.
+    HouseWorkerBacklog *last;
+    int backlogcount;
+    long long refused;
+} HouseWorker;
+
+static HouseWorker *Workers = 0;
+static int WorkersCount = 0;
+static int WorkerMainWakeup = -1;
+
+static __thread int WorkerSelf = 0;
+
+static housemech_worker_start *WorkerStart = 0;
+static housemech_worker_process *WorkerProcess = 0;
+static housemech_worker_forwarded *WorkerForwarded = 0;
+
+static int housemech_worker_push (HouseWorkerRing *ring,
+                                  const HouseWorkerMessage *message) {
+
+    unsigned int tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit (&ring->head, memory_order_acquire);
+
+    if (tail - head >= HOUSE_WORKER_RING) return 0; // Full.
+
+    ring->items[tail % HOUSE_WORKER_RING] = *message;
+    atomic_store_explicit (&ring->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+static int housemech_worker_pop (HouseWorkerRing *ring,
+                                 HouseWorkerMessage *message) {
+
+    unsigned int head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+
+    if (head == tail) return 0; // Empty.
+
+    *message = ring->items[head % HOUSE_WORKER_RING];
+    atomic_store_explicit (&ring->head, head + 1, memory_order_release);
+    return 1;
+}
+
+static int housemech_worker_depth (HouseWorkerRing *ring) {
+    return atomic_load (&ring->tail) - atomic_load (&ring->head);
+}
+
+static void housemech_worker_wakeup (int fd) {
+    uint64_t one = 1;
+    if (write (fd, &one, sizeof(one)) < 0) {
+        DEBUG ("Worker wakeup failed: %s\n", strerror(errno));
+    }
+}
+
+static char *housemech_worker_pack (int argc, const char **argv) {
+
+    int i;
+    int size = 0;
+    for (i = 0; i < argc; ++i) size += strlen(argv[i]) + 1;
+
+    char *data = malloc (size);
+    char *cursor = data;
+    for (i = 0; i < argc; ++i) {
+        int length = strlen(argv[i]) + 1;
+        memcpy (cursor, argv[i], length);
+        cursor += length;
+    }
+    return data;
+}
+
+static int housemech_worker_unpack (const HouseWorkerMessage *message,
+                                    const char **argv) {
+    int i;
+    const char *cursor = message->data;
+    for (i = 0; i < message->count; ++i) {
+        argv[i] = cursor;
+        cursor += strlen(cursor) + 1;
+    }
+    return message->count;
+}
+
+static void *housemech_worker_main (void *context) {
+
+    HouseWorker *worker = (HouseWorker *)context;
+    WorkerSelf = worker->number;
+
+    WorkerStart ();
+
+    for (;;) {
+        HouseWorkerMessage message;
+        while (housemech_worker_pop (&worker->input, &message)) {
+            const char *argv[HOUSE_WORKER_ARGS];
+            int argc = housemech_worker_unpack (&message, argv);
+            WorkerProcess (message.kind, argc, argv);
+            free (message.data);
+            atomic_fetch_add (&worker->processed, 1);
+
+            // Tell the main thread that there is room for its backlog.
+            atomic_thread_fence (memory_order_seq_cst);
+            if (atomic_load (&worker->backlogged))
+                housemech_worker_wakeup (WorkerMainWakeup);
+        }
+        // Sleep until more work is submitted. The ring is checked again
+        // after telling that this worker is sleeping, and the main thread
+        // checks the sleeping flag after queuing: no wakeup can be lost.
+        //
+        atomic_store (&worker->sleeping, 1);
+        atomic_thread_fence (memory_order_seq_cst);
+        if (housemech_worker_depth (&worker->input) <= 0) {
+            uint64_t count;
+            if (read (worker->wakeup, &count, sizeof(count)) < 0) {
+                if (errno != EINTR) sched_yield ();
+            }
+        }
+        atomic_store (&worker->sleeping, 0);
+    }
+    return 0;
+}
+
+// Process the commands forwarded by the workers (main thread only).
+//
+static void housemech_worker_drain (void) {
+
+    int i;
+    for (i = 0; i < WorkersCount; ++i) {
+        HouseWorker *worker = Workers + i;
+        HouseWorkerMessage message;
+        while (housemech_worker_pop (&worker->output, &message)) {
+            int status = 0;
+            char *result = WorkerForwarded (message.data, &status);
+            if (message.wait) {
+                worker->reply = result;
+                worker->status = status;
+                sem_post (&worker->replied);
+            } else {
+                if (status) DEBUG ("Worker %d command %s failed: %s\n",
+                                   worker->number, message.data, result);
+                free (result);
+            }
+            free (message.data);
+        }
+    }
+}
+
+// Move as many backlogged work items as possible to the worker's ring
+// (main thread only).
+//
+static void housemech_worker_flush (HouseWorker *worker) {
+
+    int moved = 0;
+    while (worker->backlog) {
+        HouseWorkerBacklog *item = worker->backlog;
+        if (!housemech_worker_push (&worker->input, &(item->message))) break;
+        worker->backlog = item->next;
+        worker->backlogcount -= 1;
+        free (item);
+        moved = 1;
+    }
+    if (!worker->backlog) {
+        worker->last = 0;
+        atomic_store (&worker->backlogged, 0);
+    }
+    if (moved) {
+        atomic_thread_fence (memory_order_seq_cst);
+        if (atomic_load (&worker->sleeping))
+            housemech_worker_wakeup (worker->wakeup);
+    }
+}
+
+static void housemech_worker_listen (int fd, int mode) {
+
+    uint64_t count;
+    if (read (fd, &count, sizeof(count)) < 0) {
+        if (errno != EAGAIN) DEBUG ("Worker wakeup: %s\n", strerror(errno));
+    }
+    housemech_worker_drain ();
+
+    int i;
+    for (i = 0; i < WorkersCount; ++i) {
+        if (Workers[i].backlog) housemech_worker_flush (Workers + i);
+    }
+}
+
+int housemech_worker_initialize (int argc, const char **argv,
+                                 housemech_worker_start *start,
+                                 housemech_worker_process *process,
+                                 housemech_worker_forwarded *forwarded) {
+    int i;
+    const char *option = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-rule-workers=", argv[i], &option)) continue;
+    }
+    if (!option) return 0;
+
+    int count = atoi (option);
+    if (count <= 0) return 0;
+    if (count > HOUSE_WORKER_MAX) count = HOUSE_WORKER_MAX;
+
+    WorkerMainWakeup = eventfd (0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (WorkerMainWakeup < 0) {
+        houselog_trace (HOUSE_FAILURE, "WORKER", "cannot create eventfd");
+        return 0;
+    }
+    echttp_listen (WorkerMainWakeup, 1, housemech_worker_listen, 1);
+
+    WorkerStart = start;
+    WorkerProcess = process;
+    WorkerForwarded = forwarded;
+
+    Workers = calloc (count, sizeof(HouseWorker));
+    for (i = 0; i < count; ++i) {
+        HouseWorker *worker = Workers + i;
+        worker->number = i + 1;
+        worker->wakeup = eventfd (0, EFD_CLOEXEC);
+        sem_init (&worker->replied, 0, 0);
+        if ((worker->wakeup < 0) ||
+            pthread_create (&(worker->thread), 0,
+                            housemech_worker_main, worker)) {
+            houselog_trace (HOUSE_FAILURE, "WORKER",
+                            "cannot start worker %d", i + 1);
+            break;
+        }
+        WorkersCount += 1;
+    }
+    DEBUG ("Started %d workers\n", WorkersCount);
+    return WorkersCount;
+}
+
+int housemech_worker_count (void) {
+    return WorkersCount;
+}
+
+int housemech_worker_self (void) {
+    return WorkerSelf;
+}
+
+static int housemech_worker_queue (HouseWorker *worker, int mandatory,
+                                   char kind, int argc, const char **argv) {
+
+    if ((!mandatory) && (worker->backlogcount >= HOUSE_WORKER_RING)) {
+        worker->refused += 1;
+        return 0;
+    }
+
+    HouseWorkerMessage message;
+    message.kind = kind;
+    message.wait = 0;
+    message.count = argc;
+    message.data = housemech_worker_pack (argc, argv);
+
+    // The backlog, if any, must go first to keep the work items in order.
+    if ((!worker->backlog) && housemech_worker_push (&worker->input, &message)) {
+        atomic_thread_fence (memory_order_seq_cst);
+        if (atomic_load (&worker->sleeping))
+            housemech_worker_wakeup (worker->wakeup);
+        return 1;
+    }
+
+    HouseWorkerBacklog *item = malloc (sizeof(HouseWorkerBacklog));
+    item->message = message;
+    item->next = 0;
+    if (worker->last) worker->last->next = item;
+    else worker->backlog = item;
+    worker->last = item;
+    worker->backlogcount += 1;
+
+    // The worker might have made room before seeing the backlogged flag.
+    atomic_store (&worker->backlogged, 1);
+    atomic_thread_fence (memory_order_seq_cst);
+    housemech_worker_flush (worker);
+    return 1;
+}
+
+int housemech_worker_submit (const char *key,
+                             char kind, int argc, const char **argv) {
+
+    if (WorkersCount <= 0) return 0;
+    if (argc > HOUSE_WORKER_ARGS) argc = HOUSE_WORKER_ARGS;
+
+    if (!key) {
+        int i;
+        for (i = 0; i < WorkersCount; ++i)
+            housemech_worker_queue (Workers + i, 1, kind, argc, argv);
+        return 1;
+    }
+
+    // FNV-1a hash of the key.
+    uint32_t hash = 2166136261u;
+    while (*key) {
+        hash ^= (unsigned char)(*key++);
+        hash *= 16777619u;
+    }
+    return housemech_worker_queue
+               (Workers + (hash % WorkersCount), 0, kind, argc, argv);
+}
+
+char *housemech_worker_forward (const char *command, int wait, int *status) {
+
+    if (WorkerSelf <= 0) return 0;
+    HouseWorker *worker = Workers + WorkerSelf - 1;
+
+    HouseWorkerMessage message;
+    message.kind = 0;
+    message.wait = wait;
+    message.count = 1;
+    message.data = strdup (command);
+
+    while (!housemech_worker_push (&worker->output, &message)) {
+        usleep (1000); // The main thread is busy.
+    }
+    atomic_fetch_add (&worker->forwarded, 1);
+    housemech_worker_wakeup (WorkerMainWakeup);
+
+    if (!wait) return 0;
+
+    while (sem_wait (&worker->replied) < 0) {
+        if (errno != EINTR) return 0;
+    }
+    if (status) *status = worker->status;
+    return worker->reply;
+}
+
+int housemech_worker_status (char *buffer, int size) {
+
+    int i;
+    int cursor;
+    const char *prefix = "";
+
+    if (WorkersCount <= 0) return 0;
+
+    cursor = snprintf (buffer, size, ",\"workers\":[");
+    if (cursor >= size) goto overflow;
+
+    for (i = 0; i < WorkersCount; ++i) {
+        HouseWorker *worker = Workers + i;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s{\"processed\":%lld,\"forwarded\":%lld"
+                            ",\"pending\":%d,\"refused\":%lld}",
+                            prefix,
+                            (long long)atomic_load (&worker->processed),
+                            (long long)atomic_load (&worker->forwarded),
+                            housemech_worker_depth (&worker->input)
+                                + worker->backlogcount,
+                            worker->refused);
+        if (cursor >= size) goto overflow;
+        prefix = ",";
+    }
+    cursor += snprintf (buffer+cursor, size-cursor, "]");
+    if (cursor >= size) goto overflow;
+
+    return cursor;
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "STATUS",
+                    "BUFFER TOO SMALL (NEED %d bytes)", cursor);
+    buffer[0] = 0;
+    return 0;
+}
@@ -0,0 +1,40 @@
+/* HouseMech - a web server for home automation
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemech_worker.h - Run the triggers on a pool of worker threads.
+ */
+typedef void housemech_worker_start (void);
+typedef void housemech_worker_process (char kind, int argc, const char **argv);
+typedef char *housemech_worker_forwarded (const char *command, int *status);
+
+int  housemech_worker_initialize (int argc, const char **argv,
+                                  housemech_worker_start *start,
+                                  housemech_worker_process *process,
+                                  housemech_worker_forwarded *forwarded);
+
+int  housemech_worker_count (void);
+int  housemech_worker_self (void);
+
+int   housemech_worker_submit (const char *key,
+                               char kind, int argc, const char **argv);
+char *housemech_worker_forward (const char *command, int wait, int *status);
+
+int  housemech_worker_status (char *buffer, int size);
+
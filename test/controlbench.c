@@ -0,0 +1,75 @@
+/* HouseMech - A simple home web service to automate actions.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * controlbench.c - Measure how fast control points are found.
+ *
+ * This program creates 100, then 1000, then 10000 control points and
+ * looks up all of them repeatedly, using housemech_control_state().
+ * The result is reported in lookups per second for each count of points.
+ *
+ * Usage: controlbench [LOOKUPS]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "housemech_control.h"
+
+#define CONTROL_BENCH_MAX 10000
+
+// No trigger is called: no control server is ever queried.
+//
+int housemech_rule_trigger_control (const char *name, const char *state) {
+    return 0;
+}
+
+static double controlbench_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1000000000.0);
+}
+
+int main (int argc, const char **argv) {
+
+    long lookups = (argc > 1) ? atol (argv[1]) : 2000000;
+
+    static char names[CONTROL_BENCH_MAX][32];
+    static const int points[] = {100, 1000, CONTROL_BENCH_MAX};
+
+    int i, j;
+    for (i = 0; i < CONTROL_BENCH_MAX; ++i)
+        snprintf (names[i], sizeof(names[i]), "point%05d", i);
+
+    for (j = 0; j < sizeof(points)/sizeof(points[0]); ++j) {
+
+        // The first lookup creates the points that do not exist yet.
+        for (i = 0; i < points[j]; ++i) housemech_control_state (names[i]);
+
+        long calls = 0;
+        double start = controlbench_now ();
+        while (calls < lookups) {
+            for (i = 0; i < points[j]; ++i) housemech_control_state (names[i]);
+            calls += points[j];
+        }
+        printf ("%5d points: %.0f lookups/s\n",
+                points[j], calls / (controlbench_now () - start));
+    }
+    return 0;
+}
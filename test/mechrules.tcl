@@ -25,7 +25,7 @@ proc POINT.mech2 {state} {
     puts "================ State of point mech1 is [House::control state mech1]"
     if {$state == "on"} {
         puts "================ Activating point mech1"
-        House::control start mech1 10 "ON mech2 CHANGE TO ON"
+        House::control start mech1 30 "ON mech2 CHANGE TO ON"
         House::event new POINT mech1 PULSE "AFTER DETECTING mech2"
     }
     puts "================ Last action for event SCRIPT mechrules.tcl: [House::event state SCRIPT mechrules.tcl]"
@@ -44,6 +44,14 @@ proc POINT.mech1 {state} {
     }
 }
 
+# Record the changes of point mech3 as events, so that test/notifymech
+# can check its state through /mech/state.
+#
+proc POINT.mech3 {state} {
+    puts "================ Control mech3 changed to $state"
+    House::event new POINT mech3 $state "NOTIFICATION TEST"
+}
+
 proc SENSOR.watchs.temp.cpu {value} {
     if {$value >= 26} {
        puts "================ Activating fan at GaragePlug1"
@@ -0,0 +1,82 @@
+/* HouseMech - A simple home web service to automate actions.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * rulebench.c - Measure how fast the triggers are called.
+ *
+ * This program loads a script with trivial triggers, then calls the
+ * event, sensor and control point triggers repeatedly. The result is
+ * reported in triggers per second for each kind of trigger.
+ *
+ * The rule module is included here so that the script can be loaded
+ * directly, without going through HouseDepot.
+ *
+ * Usage: rulebench [CALLS]
+ */
+
+#include "housemech_rule.c"
+
+static const char *RuleBenchScript =
+    "set n 0\n"
+    "proc EVENT.CONTROL {name action} {incr ::n}\n"
+    "proc SENSOR.temperature {location value} {incr ::n}\n"
+    "proc POINT.point1 {state} {incr ::n}\n";
+
+static double rulebench_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1000000000.0);
+}
+
+int main (int argc, const char **argv) {
+
+    int calls = (argc > 1) ? atoi (argv[1]) : 200000;
+    const char *options[] = {argv[0]}; // Keep the default configuration.
+
+    housemech_state_initialize (1, options);
+    housemech_rule_initialize (1, options);
+    if (!housemech_rule_load (RuleBenchScript)) {
+        fprintf (stderr, "cannot load the benchmark script\n");
+        return 1;
+    }
+    HouseMechReady = 1;
+
+    int i;
+    double start = rulebench_now ();
+    for (i = 0; i < calls; ++i) {
+        housemech_rule_trigger_event ("CONTROL", "point1", "off");
+    }
+    printf ("event:   %.0f triggers/s\n", calls / (rulebench_now() - start));
+
+    start = rulebench_now ();
+    for (i = 0; i < calls; ++i) {
+        housemech_rule_trigger_sensor
+            ("kitchen", "temperature", (i & 1) ? "25.1" : "25.2");
+    }
+    printf ("sensor:  %.0f triggers/s\n", calls / (rulebench_now() - start));
+
+    start = rulebench_now ();
+    for (i = 0; i < calls; ++i) {
+        housemech_rule_trigger_control ("point1", (i & 1) ? "on" : "off");
+    }
+    printf ("control: %.0f triggers/s\n", calls / (rulebench_now() - start));
+
+    Tcl_Obj *count = Tcl_GetVar2Ex (HouseMechInterpreter, "n", 0, 0);
+    printf ("(%s triggers executed)\n", count ? Tcl_GetString (count) : "no");
+    return 0;
+}
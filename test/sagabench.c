@@ -0,0 +1,143 @@
+/* HouseMech - A simple home web service to automate actions.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * sagabench.c - Measure how fast HouseSaga records are decoded.
+ *
+ * This program parses a canned HouseSaga response and then decodes its
+ * records repeatedly, first with one echttp_json_search() call per item
+ * (the way HouseMech used to do it), then with housemech_saga_decode().
+ * The result is reported in records per second for each method.
+ *
+ * Usage: sagabench [RECORDS [ROUNDS]]
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "echttp_json.h"
+
+#include "housemech_saga.h"
+
+static double sagabench_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1000000000.0);
+}
+
+// Build a response similar to what HouseSaga returns for /log/events.
+//
+static char *sagabench_response (int count) {
+
+    int size = 256 + (count * 128);
+    char *buffer = malloc (size);
+    int cursor = snprintf (buffer, size,
+                           "{\"host\":\"bench\",\"timestamp\":1700000000,"
+                           "\"saga\":{\"latest\":%d,\"events\":[", count);
+    int i;
+    for (i = count; i > 0; --i) {
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s[%lld,\"CONTROL\",\"point%d\",\"%s\","
+                            "\"requested by schedule\",\"housesprinkler\","
+                            "\"bench\",%d]",
+                            (i < count) ? "," : "",
+                            1700000000000LL + i, i % 32,
+                            (i & 1) ? "ON" : "OFF", i);
+    }
+    snprintf (buffer+cursor, size-cursor, "]}}");
+    return buffer;
+}
+
+// The decoding method used before housemech_saga_decode() was added.
+//
+static int sagabench_search (const ParserToken *inner,
+                             HouseMechSagaRecord *decoded) {
+
+    if (inner->type != PARSER_ARRAY) return 0;
+
+    int ididx = echttp_json_search (inner, "[7]");
+    decoded->id = inner[ididx].value.integer;
+    int timestampidx = echttp_json_search (inner, "[0]");
+    decoded->timestamp = inner[timestampidx].value.integer;
+    int categoryidx = echttp_json_search (inner, "[1]");
+    decoded->category = inner[categoryidx].value.string;
+    int nameidx = echttp_json_search (inner, "[2]");
+    decoded->name = inner[nameidx].value.string;
+    int actionidx = echttp_json_search (inner, "[3]");
+    decoded->action = inner[actionidx].value.string;
+    return 1;
+}
+
+typedef int sagabench_method (const ParserToken *record,
+                              HouseMechSagaRecord *decoded);
+
+static void sagabench_run (const char *title, sagabench_method *method,
+                           const ParserToken *records, const int *list,
+                           int count, int rounds) {
+
+    long long checksum = 0;
+    double start = sagabench_now ();
+    int i, j;
+    for (i = 0; i < rounds; ++i) {
+        for (j = count - 1; j >= 0; --j) {
+            HouseMechSagaRecord record;
+            if (!method (records + list[j], &record)) continue;
+            checksum += record.id + record.name[0];
+        }
+    }
+    double elapsed = sagabench_now () - start;
+    printf ("%s: %.0f records/s (checksum %lld)\n",
+            title, (count * (double)rounds) / elapsed, checksum);
+}
+
+int main (int argc, const char **argv) {
+
+    int count = (argc > 1) ? atoi (argv[1]) : 1000;
+    int rounds = (argc > 2) ? atoi (argv[2]) : 1000;
+
+    char *data = sagabench_response (count);
+
+    int tokencount = echttp_json_estimate (data);
+    ParserToken *tokens = calloc (tokencount, sizeof(ParserToken));
+    const char *error = echttp_json_parse (data, tokens, &tokencount);
+    if (error) {
+        fprintf (stderr, "syntax error, %s\n", error);
+        return 1;
+    }
+
+    int records = echttp_json_search (tokens, ".saga.events");
+    if ((records < 0) || (tokens[records].length != count)) {
+        fprintf (stderr, "invalid response\n");
+        return 1;
+    }
+    int *list = calloc (count, sizeof(int));
+    error = echttp_json_enumerate (tokens+records, list, count);
+    if (error) {
+        fprintf (stderr, "cannot enumerate records, %s\n", error);
+        return 1;
+    }
+
+    printf ("%d records, %d rounds\n", count, rounds);
+    sagabench_run ("search", sagabench_search,
+                   tokens+records, list, count, rounds);
+    sagabench_run ("decode", housemech_saga_decode,
+                   tokens+records, list, count, rounds);
+    return 0;
+}
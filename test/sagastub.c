@@ -0,0 +1,287 @@
+/* HouseMech - A simple home web service to automate actions.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * sagastub.c - A minimal stand-in for the HouseSaga history service.
+ *
+ * This program serves /saga/log/events and /saga/log/sensor/data the
+ * way HouseSaga does, from records that it generates on its own. It is
+ * used to test the HouseMech history feed without a real history server.
+ *
+ * The since (milliseconds) and known (record ID) parameters are honored:
+ * if no record was added since the known ID, the response is a 304 status.
+ * The limit parameter is honored too: the response is then limited to
+ * the oldest records after known. The list is always newest first.
+ *
+ * The wait parameter (seconds) is honored as well: if no record was added
+ * since the known ID, the request is held until new records are generated
+ * or the wait period expires (long poll). This stand-in serves only one
+ * request at a time, so the other stream's request is delayed meanwhile.
+ *
+ * Restarting this program with a different backlog simulates a restart of
+ * the history server: the record IDs start again from 1, which HouseMech
+ * must handle without skipping any record.
+ *
+ * Options:
+ *
+ * -rate=N       Generate N new records per period for each stream.
+ * -period=N     Generate the new records every N seconds (default: 1).
+ *               A long period leaves the long polls idle, see the wait
+ *               parameter.
+ * -backlog=N    Generate N records for each stream when starting.
+ * -newest       Return the newest records when the limit is exceeded,
+ *               leaving a gap in the list. This exercises the gap detection
+ *               in HouseMech (see the -feed-page option).
+ * -sparse       Leave random gaps in the record IDs, as a server is allowed
+ *               to do. This must not cause HouseMech to fetch all records.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "echttp.h"
+#include "houseportalclient.h"
+
+typedef struct {
+    long long timestamp;
+    long long id;
+    int value;
+} SagaStubRecord;
+
+typedef struct {
+    const char *list;
+    const char *category;
+    const char *unit;
+    SagaStubRecord *records;
+    int count;
+    int size;
+    long long latest;
+} SagaStubStream;
+
+static SagaStubStream Streams[] = {
+    {"events", "STUB", ""},
+    {"sensor", "stub", "F"}
+};
+
+static int SagaStubRate = 1;
+static int SagaStubPeriod = 1;
+static int SagaStubNewest = 0;
+static int SagaStubSparse = 0;
+
+static char SagaStubHost[256];
+
+static char *SagaStubBuffer = 0;
+static int SagaStubBufferSize = 0;
+
+static long long sagastub_now (void) {
+    struct timeval now;
+    gettimeofday (&now, 0);
+    return (now.tv_sec * 1000LL) + (now.tv_usec / 1000);
+}
+
+static void sagastub_add (SagaStubStream *stream, long long timestamp) {
+
+    if (stream->count >= stream->size) {
+        stream->size += 1024;
+        stream->records =
+            realloc (stream->records, stream->size * sizeof(SagaStubRecord));
+    }
+    SagaStubRecord *record = stream->records + stream->count;
+    record->timestamp = timestamp;
+    stream->latest += SagaStubSparse ? 1 + (random() % 3) : 1;
+    record->id = stream->latest;
+    stream->count += 1;
+    record->value = (int)(record->id % 100);
+}
+
+static void sagastub_generate (time_t now) {
+
+    static time_t LastGenerated = 0;
+
+    if (now < LastGenerated + SagaStubPeriod) return;
+    LastGenerated = now;
+
+    long long timestamp = sagastub_now ();
+    int i, j;
+    for (i = 0; i < sizeof(Streams)/sizeof(Streams[0]); ++i) {
+        for (j = 0; j < SagaStubRate; ++j)
+            sagastub_add (Streams + i, timestamp);
+    }
+}
+
+static const char *sagastub_list (SagaStubStream *stream) {
+
+    long long since = 0;
+    long long known = 0;
+    int limit = 0;
+    int wait = 0;
+
+    const char *value = echttp_parameter_get ("since");
+    if (value) since = atoll (value);
+    value = echttp_parameter_get ("known");
+    if (value) known = atoll (value);
+    value = echttp_parameter_get ("limit");
+    if (value) limit = atoi (value);
+    value = echttp_parameter_get ("wait");
+    if (value) wait = atoi (value);
+
+    // Long poll: hold the request until some new record is generated.
+    if (known && (known == stream->latest) && (wait > 0)) {
+        time_t deadline = time(0) + wait;
+        while ((known == stream->latest) && (time(0) < deadline)) {
+            usleep (100000);
+            sagastub_generate (time(0));
+        }
+    }
+
+    if (known && (known == stream->latest)) {
+        echttp_error (304, "Not Modified");
+        return "";
+    }
+
+    // Skip the known records first (IDs may have gaps, but are sorted),
+    // then the records older than since. An unknown ID means that this
+    // server restarted: nothing is skipped in that case.
+    int start = 0;
+    if (known > 0 && known < stream->latest) {
+        int high = stream->count;
+        while (start < high) {
+            int middle = (start + high) / 2;
+            if (stream->records[middle].id <= known)
+                start = middle + 1;
+            else
+                high = middle;
+        }
+    }
+    while ((start < stream->count) &&
+           (stream->records[start].timestamp < since)) start += 1;
+    int end = stream->count;
+
+    if ((limit > 0) && (end - start > limit)) {
+        if (SagaStubNewest)
+            start = end - limit;
+        else
+            end = start + limit;
+    }
+
+    int needed = 256 + ((end - start) * 128);
+    if (needed > SagaStubBufferSize) {
+        SagaStubBufferSize = needed;
+        SagaStubBuffer = realloc (SagaStubBuffer, SagaStubBufferSize);
+    }
+    int cursor = snprintf (SagaStubBuffer, SagaStubBufferSize,
+                           "{\"host\":\"%s\",\"timestamp\":%lld,"
+                           "\"saga\":{\"latest\":%lld,\"%s\":[",
+                           SagaStubHost, sagastub_now() / 1000,
+                           stream->latest, stream->list);
+    const char *sep = "";
+    int i;
+    for (i = end - 1; i >= start; --i) {
+        SagaStubRecord *record = stream->records + i;
+        cursor += snprintf (SagaStubBuffer+cursor, SagaStubBufferSize-cursor,
+                            "%s[%lld,\"%s\",\"point%d\",\"%d\",\"%s\","
+                            "\"sagastub\",\"%s\",%lld]",
+                            sep, record->timestamp, stream->category,
+                            (int)(record->id % 10), record->value,
+                            stream->unit, SagaStubHost, record->id);
+        sep = ",";
+    }
+    snprintf (SagaStubBuffer+cursor, SagaStubBufferSize-cursor, "]}}");
+    echttp_content_type_json ();
+    return SagaStubBuffer;
+}
+
+static const char *sagastub_events (const char *method, const char *uri,
+                                    const char *data, int length) {
+    return sagastub_list (Streams);
+}
+
+static const char *sagastub_sensor (const char *method, const char *uri,
+                                    const char *data, int length) {
+    return sagastub_list (Streams + 1);
+}
+
+static void sagastub_background (int fd, int mode) {
+
+    static time_t LastCall = 0;
+    time_t now = time(0);
+
+    if (now == LastCall) return;
+    LastCall = now;
+
+    houseportal_background (now);
+    sagastub_generate (now);
+}
+
+int main (int argc, const char **argv) {
+
+    // These strange statements are to make sure that fds 0 to 2 are
+    // reserved, since this application might output some errors.
+    // 3 descriptors are wasted if 0, 1 and 2 are already open. No big deal.
+    //
+    open ("/dev/null", O_RDONLY);
+    dup(open ("/dev/null", O_WRONLY));
+
+    gethostname (SagaStubHost, sizeof(SagaStubHost));
+
+    int i;
+    int backlog = 0;
+    const char *option;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-rate=", argv[i], &option)) {
+            SagaStubRate = atoi (option);
+        } else if (echttp_option_match ("-period=", argv[i], &option)) {
+            SagaStubPeriod = atoi (option);
+            if (SagaStubPeriod < 1) SagaStubPeriod = 1;
+        } else if (echttp_option_match ("-backlog=", argv[i], &option)) {
+            backlog = atoi (option);
+        } else if (echttp_option_present ("-newest", argv[i])) {
+            SagaStubNewest = 1;
+        } else if (echttp_option_present ("-sparse", argv[i])) {
+            SagaStubSparse = 1;
+        }
+    }
+
+    // The backlog ends now, one record per millisecond, so that it is
+    // newer than anything HouseMech got before this program restarted.
+    long long timestamp = sagastub_now () - backlog;
+    for (i = 0; i < backlog; ++i) {
+        sagastub_add (Streams, timestamp + i);
+        sagastub_add (Streams + 1, timestamp + i);
+    }
+
+    echttp_default ("-http-service=dynamic");
+
+    argc = echttp_open (argc, argv);
+    if (echttp_dynamic_port()) {
+        static const char *path[] = {"history:/saga"};
+        houseportal_initialize (argc, argv);
+        houseportal_declare (echttp_port(4), path, 1);
+    }
+
+    echttp_route_uri ("/saga/log/events", sagastub_events);
+    echttp_route_uri ("/saga/log/sensor/data", sagastub_sensor);
+
+    echttp_background (&sagastub_background);
+    echttp_loop();
+}